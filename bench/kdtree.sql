@@ -0,0 +1,41 @@
+-- Compare point_kd_ops with point_quadtree_ops: build time, index size and
+-- lookup latency on uniformly distributed points like data/point.data.
+--
+-- Run from the source directory:
+--     psql -X -f bench/kdtree.sql
+
+\set npoints 1000000
+\set nlookups 10000
+
+CREATE EXTENSION IF NOT EXISTS spgist;
+
+DROP TABLE IF EXISTS bench_points;
+CREATE TABLE bench_points AS
+	SELECT point(random() * 10, random() * 10) AS p
+	FROM generate_series(1, :npoints);
+
+DROP TABLE IF EXISTS bench_probes;
+CREATE TABLE bench_probes AS
+	SELECT p FROM bench_points ORDER BY random() LIMIT :nlookups;
+
+SET enable_seqscan = off;
+
+\timing on
+CREATE INDEX bench_points_quad ON bench_points USING spgist (p point_quadtree_ops);
+SELECT count(*) FROM bench_probes b WHERE EXISTS
+	(SELECT 1 FROM bench_points t WHERE t.p ~= b.p);
+\timing off
+SELECT pg_size_pretty(pg_relation_size('bench_points_quad')) AS quadtree_size;
+SELECT spgstat('bench_points_quad');
+DROP INDEX bench_points_quad;
+
+\timing on
+CREATE INDEX bench_points_kd ON bench_points USING spgist (p point_kd_ops);
+SELECT count(*) FROM bench_probes b WHERE EXISTS
+	(SELECT 1 FROM bench_points t WHERE t.p ~= b.p);
+\timing off
+SELECT pg_size_pretty(pg_relation_size('bench_points_kd')) AS kdtree_size;
+SELECT spgstat('bench_points_kd');
+
+DROP TABLE bench_probes;
+DROP TABLE bench_points;
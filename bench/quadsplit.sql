@@ -0,0 +1,34 @@
+-- Compare quadtree picksplit strategies on skewed points.
+--
+-- A few dense "cities" among sparse "ocean" points; the arithmetic mean
+-- centroid lands between clusters, the median stays inside the bulk of
+-- the points. spgstat() reports depth and fanout of both trees.
+--
+-- Run from the source directory:
+--     psql -X -f bench/quadsplit.sql
+
+\set npoints 200000
+\timing on
+
+CREATE EXTENSION IF NOT EXISTS spgist;
+
+DROP TABLE IF EXISTS bench_skewed;
+CREATE TABLE bench_skewed AS
+	SELECT point(c.x + random() * 0.01, c.y + random() * 0.01) AS p
+	FROM generate_series(1, :npoints * 9 / 10) AS i,
+		 (VALUES (10.0, 10.0), (500.0, 20.0), (990.0, 990.0))
+			AS c(x, y)
+	WHERE i % 3 = (c.x::int % 3)
+	UNION ALL
+	SELECT point(random() * 1000, random() * 1000)
+	FROM generate_series(1, :npoints / 10);
+
+CREATE INDEX bench_skewed_mean ON bench_skewed USING spgist (p point_quadtree_ops);
+CREATE INDEX bench_skewed_median ON bench_skewed USING spgist (p point_quadtree_median_ops);
+
+\timing off
+
+SELECT spgstat('bench_skewed_mean');
+SELECT spgstat('bench_skewed_median');
+
+DROP TABLE bench_skewed;
@@ -0,0 +1,30 @@
+-- Generates suite_points with :rows points in [0,100)x[0,100) and
+-- suite_probes with 10000 of them.
+--
+--   uniform     independent uniform coordinates
+--   clustered   gaussian clouds (sigma 0.5) around 100 fixed centers
+--   duplicates  integer grid, 10^4 distinct values, so a value has
+--               rows / 10^4 copies, many leaf pages of them at 10^7 rows
+
+SELECT setseed(0.42);
+
+DROP TABLE IF EXISTS suite_points;
+CREATE TABLE suite_points (p point);
+
+INSERT INTO suite_points
+	SELECT CASE :'dist'
+		WHEN 'uniform' THEN
+			point(random() * 100, random() * 100)
+		WHEN 'clustered' THEN
+			point((c * 37 % 100) + 0.5 * sqrt(-2 * ln(1 - random())) * cos(2 * pi() * random()),
+				  (c * 61 % 100) + 0.5 * sqrt(-2 * ln(1 - random())) * cos(2 * pi() * random()))
+		WHEN 'duplicates' THEN
+			point(floor(random() * 100), floor(random() * 100))
+		END
+	FROM (SELECT i, i % 100 AS c FROM generate_series(1, :rows) i) s;
+
+DROP TABLE IF EXISTS suite_probes;
+CREATE TABLE suite_probes AS
+	SELECT p FROM suite_points ORDER BY random() LIMIT 10000;
+
+VACUUM ANALYZE suite_points;
@@ -0,0 +1,20 @@
+-- Generates suite_text with :rows URL-like strings, rows / 100 hosts with
+-- long shared prefixes, and suite_probes with 10000 of them.
+
+SELECT setseed(0.42);
+
+DROP TABLE IF EXISTS suite_text;
+CREATE TABLE suite_text (t text);
+
+INSERT INTO suite_text
+	SELECT 'http://www.host' || floor(random() * greatest(:rows / 100, 10)) || '.'
+		|| (ARRAY['com', 'co.uk', 'org', 'net', 'de'])[1 + floor(random() * 5)]
+		|| '/' || (ARRAY['index', 'about', 'products', 'news', 'contact'])[1 + floor(random() * 5)]
+		|| '/page' || floor(random() * 1000) || '.html'
+	FROM generate_series(1, :rows);
+
+DROP TABLE IF EXISTS suite_probes;
+CREATE TABLE suite_probes AS
+	SELECT t FROM suite_text ORDER BY random() LIMIT 10000;
+
+VACUUM ANALYZE suite_text;
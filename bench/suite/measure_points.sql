@@ -0,0 +1,20 @@
+-- Build time, size and lookup latency of an index on suite_points.
+-- Variables: run, dataset, rows, opclass. Leaves suite_points_idx behind.
+
+DROP INDEX IF EXISTS suite_points_idx;
+
+INSERT INTO suite_results VALUES (:'run', :'dataset', :rows, :'opclass', 'build', 0,
+	suite_time('CREATE INDEX suite_points_idx ON suite_points USING spgist (p ' || :'opclass' || ')'),
+	'ms');
+
+INSERT INTO suite_results VALUES (:'run', :'dataset', :rows, :'opclass', 'size', 0,
+	pg_relation_size('suite_points_idx'), 'bytes');
+
+SET enable_seqscan = off;
+SET enable_bitmapscan = off;
+
+-- 10000 probes, all present
+INSERT INTO suite_results VALUES (:'run', :'dataset', :rows, :'opclass', 'lookup', 0,
+	suite_time('SELECT count(*) FROM suite_probes b WHERE EXISTS
+				(SELECT 1 FROM suite_points t WHERE t.p ~= b.p)', 3) / 10000.0,
+	'ms');
@@ -0,0 +1,10 @@
+-- Box scans on suite_points_idx: 1000 boxes of 1x1 at probe points.
+-- Variables: run, dataset, rows, opclass.
+
+SET enable_seqscan = off;
+
+INSERT INTO suite_results VALUES (:'run', :'dataset', :rows, :'opclass', 'range', 0,
+	suite_time('SELECT sum((SELECT count(*) FROM suite_points t
+							WHERE t.p <@ box(b.p, point(b.p[0] + 1, b.p[1] + 1))))
+				FROM (SELECT p FROM suite_probes LIMIT 1000) b', 3) / 1000.0,
+	'ms');
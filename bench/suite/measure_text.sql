@@ -0,0 +1,36 @@
+-- Build time, size, lookup, prefix and range scan latency of an index on
+-- suite_text. Variables: run, dataset, rows, opclass. Leaves
+-- suite_text_idx behind.
+
+DROP INDEX IF EXISTS suite_text_idx;
+
+INSERT INTO suite_results VALUES (:'run', :'dataset', :rows, :'opclass', 'build', 0,
+	suite_time('CREATE INDEX suite_text_idx ON suite_text USING spgist (t ' || :'opclass' || ')'),
+	'ms');
+
+INSERT INTO suite_results VALUES (:'run', :'dataset', :rows, :'opclass', 'size', 0,
+	pg_relation_size('suite_text_idx'), 'bytes');
+
+SET enable_seqscan = off;
+SET enable_bitmapscan = off;
+
+INSERT INTO suite_results VALUES (:'run', :'dataset', :rows, :'opclass', 'lookup', 0,
+	suite_time('SELECT count(*) FROM suite_probes b WHERE EXISTS
+				(SELECT 1 FROM suite_text t WHERE t.t = b.t)', 3) / 10000.0,
+	'ms');
+
+SET enable_bitmapscan = on;
+
+-- all URLs of the probe's host
+INSERT INTO suite_results VALUES (:'run', :'dataset', :rows, :'opclass', 'prefix', 0,
+	suite_time('SELECT sum((SELECT count(*) FROM suite_text t
+							WHERE t.t ^@ substring(b.t from ''^http://[^/]*/'')))
+				FROM (SELECT t FROM suite_probes LIMIT 1000) b', 3) / 1000.0,
+	'ms');
+
+-- the probe and URLs extending it (up to the probe followed by '~')
+INSERT INTO suite_results VALUES (:'run', :'dataset', :rows, :'opclass', 'range', 0,
+	suite_time('SELECT sum((SELECT count(*) FROM suite_text t
+							WHERE t.t ~>=~ b.t AND t.t ~<~ (b.t || ''~'')))
+				FROM (SELECT t FROM suite_probes LIMIT 1000) b', 3) / 1000.0,
+	'ms');
@@ -0,0 +1,20 @@
+-- WAL volume of an index on a copy of :tbl: bytes written by build, and
+-- bytes per row inserting suite_probes into it, net of the heap's own WAL.
+-- Variables: run, dataset, rows, opclass, tbl, col.
+
+DROP TABLE IF EXISTS suite_wal_plain, suite_wal_indexed;
+CREATE TABLE suite_wal_plain AS SELECT * FROM :tbl;
+CREATE TABLE suite_wal_indexed AS SELECT * FROM :tbl;
+
+INSERT INTO suite_results VALUES (:'run', :'dataset', :rows, :'opclass', 'build_wal', 0,
+	suite_wal('CREATE INDEX suite_wal_idx ON suite_wal_indexed USING spgist ('
+			  || :'col' || ' ' || :'opclass' || ')'),
+	'bytes');
+
+-- both tables end the same, so heap pages and full page writes match
+INSERT INTO suite_results VALUES (:'run', :'dataset', :rows, :'opclass', 'insert_wal', 0,
+	(suite_wal('INSERT INTO suite_wal_indexed SELECT * FROM suite_probes') -
+	 suite_wal('INSERT INTO suite_wal_plain SELECT * FROM suite_probes')) / 10000.0,
+	'bytes');
+
+DROP TABLE suite_wal_plain, suite_wal_indexed;
@@ -0,0 +1,3 @@
+\setrandom x 0 10000000
+\setrandom y 0 10000000
+INSERT INTO suite_points VALUES (point(:x / 100000.0, :y / 100000.0));
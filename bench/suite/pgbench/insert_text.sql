@@ -0,0 +1,3 @@
+\setrandom h 0 1000000
+\setrandom n 0 999
+INSERT INTO suite_text VALUES ('http://www.host' || :h || '.com/index/page' || :n || '.html');
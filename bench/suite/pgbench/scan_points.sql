@@ -0,0 +1,4 @@
+-- probes are the integer grid of the duplicates dataset, see gen_points.sql
+\setrandom x 0 99
+\setrandom y 0 99
+SELECT count(*) FROM suite_points WHERE p ~= point(:x, :y);
@@ -0,0 +1,2 @@
+\setrandom h 0 1000
+SELECT count(*) FROM suite_text WHERE t ^@ ('http://www.host' || :h || '.');
@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# End-to-end benchmark suite: build time, index size, lookups, range and
+# prefix scans, WAL bytes of build and per insert, and concurrent
+# insert/scan throughput with pgbench, for
+#   points: uniform, clustered and duplicate-heavy, with every point opclass
+#   text:   URL-like strings with text_ops
+# at every requested number of rows.
+#
+# Usage (connection from the usual PG* environment variables):
+#     bench/suite/run.sh [rows ...]
+#
+#     ROWS      default "100000 1000000 10000000 100000000"
+#     CLIENTS   pgbench client counts, default "1 4 16"
+#     DURATION  seconds per pgbench run, default 30
+#     OUT       CSV output, default suite-<run>.csv
+#
+# Every measurement is also kept in table suite_results, so results of
+# earlier runs can be compared by the run column.
+
+set -e
+
+cd "$(dirname "$0")"
+
+ROWS=${*:-${ROWS:-"100000 1000000 10000000 100000000"}}
+CLIENTS=${CLIENTS:-"1 4 16"}
+DURATION=${DURATION:-30}
+RUN=$(date -u +%Y%m%dT%H%M%SZ)
+OUT=${OUT:-suite-$RUN.csv}
+
+PSQL="psql -X -q -v ON_ERROR_STOP=1 -v run=$RUN"
+
+# pgbench throughput (tps excluding connections) of the given scripts
+tps()
+{
+	clients=$1
+	shift
+	pgbench -n -c "$clients" -j "$clients" -T "$DURATION" "$@" |
+		sed -n 's/^tps = \([0-9.]*\) (excluding.*/\1/p'
+}
+
+# record dataset rows opclass metric clients value unit
+record()
+{
+	$PSQL -c "INSERT INTO suite_results VALUES ('$RUN', '$1', $2, '$3', '$4', $5, $6, '$7')"
+}
+
+$PSQL -f setup.sql
+
+for rows in $ROWS
+do
+	for dist in uniform clustered duplicates
+	do
+		for opclass in point_quadtree_ops point_quadtree_median_ops point_kd_ops
+		do
+			# pgbench inserts, so every opclass starts from fresh data
+			$PSQL -v rows="$rows" -v dist="$dist" -f gen_points.sql
+
+			$PSQL -v dataset="points_$dist" -v rows="$rows" -v opclass="$opclass" \
+				-f measure_points.sql
+			# point_kd_ops supports ~= only
+			if [ "$opclass" != point_kd_ops ]
+			then
+				$PSQL -v dataset="points_$dist" -v rows="$rows" -v opclass="$opclass" \
+					-f measure_range.sql
+			fi
+			$PSQL -v dataset="points_$dist" -v rows="$rows" -v opclass="$opclass" \
+				-v tbl=suite_points -v col=p -f measure_wal.sql
+
+			for c in $CLIENTS
+			do
+				record "points_$dist" "$rows" "$opclass" mixed "$c" \
+					"$(tps "$c" -f pgbench/insert_points.sql -f pgbench/scan_points.sql)" tps
+			done
+		done
+	done
+
+	$PSQL -v rows="$rows" -f gen_text.sql
+	$PSQL -v dataset=text_urls -v rows="$rows" -v opclass=text_ops -f measure_text.sql
+	$PSQL -v dataset=text_urls -v rows="$rows" -v opclass=text_ops \
+		-v tbl=suite_text -v col=t -f measure_wal.sql
+	for c in $CLIENTS
+	do
+		record text_urls "$rows" text_ops mixed "$c" \
+			"$(tps "$c" -f pgbench/insert_text.sql -f pgbench/scan_text.sql)" tps
+	done
+done
+
+$PSQL -c "DROP TABLE IF EXISTS suite_points, suite_text, suite_probes"
+
+psql -X -q -c "COPY (SELECT * FROM suite_results WHERE run = '$RUN'
+	ORDER BY dataset, nrows, opclass, metric, clients) TO STDOUT WITH CSV HEADER" > "$OUT"
+
+echo "results in $OUT"
@@ -0,0 +1,48 @@
+-- Objects shared by the benchmark suite, see run.sh.
+
+CREATE EXTENSION IF NOT EXISTS spgist;
+
+CREATE TABLE IF NOT EXISTS suite_results (
+	run			text,		-- start time of run.sh
+	dataset		text,
+	nrows		int8,
+	opclass		text,
+	metric		text,
+	clients		int4,		-- 0 for single session measurements
+	value		float8,
+	unit		text
+);
+
+-- Milliseconds per execution of query, averaged over repeat executions
+CREATE OR REPLACE FUNCTION suite_time(query text, repeat int4 DEFAULT 1)
+RETURNS float8 AS $$
+DECLARE
+	t0	timestamptz;
+BEGIN
+	t0 := clock_timestamp();
+	FOR i IN 1 .. repeat LOOP
+		EXECUTE query;
+	END LOOP;
+	RETURN extract(epoch FROM clock_timestamp() - t0) * 1000.0 / repeat;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Byte position of a 9.1 WAL location 'X/Y', the last segment of every
+-- logical xlog file is never used
+CREATE OR REPLACE FUNCTION suite_xlog_bytes(loc text)
+RETURNS float8 AS $$
+	SELECT ('x' || lpad(split_part($1, '/', 1), 8, '0'))::bit(32)::int8 * 4278190080.0 +
+		   ('x' || lpad(split_part($1, '/', 2), 8, '0'))::bit(32)::int8
+$$ LANGUAGE sql IMMUTABLE;
+
+-- WAL bytes inserted while executing query
+CREATE OR REPLACE FUNCTION suite_wal(query text)
+RETURNS float8 AS $$
+DECLARE
+	l0	text;
+BEGIN
+	l0 := pg_current_xlog_insert_location();
+	EXECUTE query;
+	RETURN suite_xlog_bytes(pg_current_xlog_insert_location()) - suite_xlog_bytes(l0);
+END;
+$$ LANGUAGE plpgsql;
@@ -0,0 +1,37 @@
+-- Microbenchmark for prefix matching in text_ops.
+--
+-- Scales data/text.data up by repeating every URL under a number of long
+-- shared prefixes, then times index build (choose/picksplit) and equality
+-- lookups (inner_consistent/leaf_consistent).
+--
+-- Run from the source directory:
+--     psql -X -f bench/textprefix.sql
+
+\set scale 200
+\timing on
+
+CREATE EXTENSION IF NOT EXISTS spgist;
+
+DROP TABLE IF EXISTS bench_text_src;
+CREATE TABLE bench_text_src(t text);
+\copy bench_text_src from 'data/text.data'
+
+DROP TABLE IF EXISTS bench_text;
+CREATE TABLE bench_text AS
+	SELECT 'http://mirror-' || i || '.archive.example.co.uk/static/content/'
+			|| substr(t, 8) AS t
+	FROM bench_text_src, generate_series(1, :scale) AS i;
+
+VACUUM ANALYZE bench_text;
+
+CREATE INDEX bench_text_idx ON bench_text USING spgist (t);
+
+SET enable_seqscan = off;
+
+SELECT count(*) FROM bench_text b, bench_text_src s
+	WHERE b.t = 'http://mirror-' || (:scale / 2) || '.archive.example.co.uk/static/content/'
+				|| substr(s.t, 8);
+
+\timing off
+DROP TABLE bench_text;
+DROP TABLE bench_text_src;
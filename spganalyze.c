@@ -0,0 +1,360 @@
+#include "postgres.h"
+
+#include "access/genam.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_type.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+
+#include "spgist.h"
+
+/*
+ * spg_analyze(index, sample_pct) walks the tree from the root and reports
+ * one row per level: level 1 is the root inner tuple, leaf chains hanging
+ * off inner tuples of level n are counted at level n + 1.
+ *
+ * Only AccessShareLock on the index and a share lock on one buffer at a
+ * time are held, so concurrent inserts go on. A link changed under us may
+ * point to a tuple of other kind or past the end of page, such links are
+ * skipped. With sample_pct < 100 every child link is followed with that
+ * probability, counts then describe the sampled part of the tree only,
+ * averages and distributions stay representative.
+ *
+ * Page fill and placeholders (tuples left behind by addNode moves, not
+ * reachable by links) are counted for every page when it is reached for
+ * the first time, at that level.
+ */
+
+/* addNode replaces a moved inner tuple by a redirect */
+#define SpGistIsPlaceholder(page, i) \
+	SGITISREDIRECT((SpGistInnerTuple) PageGetItem((page), PageGetItemId((page), (i))))
+
+/* power of two buckets of histograms: [1], [2,3], [4,7], ... */
+#define SPG_ANALYZE_NBUCKETS	16
+
+typedef struct SpGistLevelStat
+{
+	int64	innerTuples;
+	int64	nodes;
+	int64	fanoutHist[SPG_ANALYZE_NBUCKETS];
+	int64	prefixes;
+	int64	prefixBytes;
+	int64	leafChains;
+	int64	leafTuples;
+	int		maxChain;
+	int64	chainHist[SPG_ANALYZE_NBUCKETS];
+	int		innerPages;
+	double	innerFill;
+	int		leafPages;
+	double	leafFill;
+	int64	placeholders;
+} SpGistLevelStat;
+
+typedef struct SpGistAnalyzeItem
+{
+	BlockNumber		blkno;
+	OffsetNumber	offset;
+	int				level;
+} SpGistAnalyzeItem;
+
+typedef struct SpGistAnalyzeState
+{
+	SpGistLevelStat		*levels;
+	int					nLevels;
+	int					maxLevels;
+	SpGistAnalyzeItem	*stack;
+	int					nStack;
+	int					maxStack;
+	bool				*seenPages;
+	BlockNumber			nPages;
+} SpGistAnalyzeState;
+
+static int
+histBucket(int n)
+{
+	int		b = 0;
+
+	while(n > 1 && b < SPG_ANALYZE_NBUCKETS - 1)
+	{
+		n >>= 1;
+		b++;
+	}
+
+	return b;
+}
+
+static SpGistLevelStat *
+getLevel(SpGistAnalyzeState *as, int level)
+{
+	if (level > as->maxLevels)
+	{
+		int		newMax = Max(as->maxLevels * 2, level);
+
+		as->levels = repalloc(as->levels, sizeof(SpGistLevelStat) * newMax);
+		memset(as->levels + as->maxLevels, 0,
+			   sizeof(SpGistLevelStat) * (newMax - as->maxLevels));
+		as->maxLevels = newMax;
+	}
+
+	as->nLevels = Max(as->nLevels, level);
+
+	return as->levels + level - 1;
+}
+
+static void
+pushItem(SpGistAnalyzeState *as, BlockNumber blkno, OffsetNumber offset, int level)
+{
+	if (as->nStack >= as->maxStack)
+	{
+		as->maxStack *= 2;
+		as->stack = repalloc(as->stack, sizeof(SpGistAnalyzeItem) * as->maxStack);
+	}
+
+	as->stack[as->nStack].blkno = blkno;
+	as->stack[as->nStack].offset = offset;
+	as->stack[as->nStack].level = level;
+	as->nStack++;
+}
+
+/*
+ * Fill and placeholders of a page, once per page
+ */
+static void
+analyzePage(SpGistAnalyzeState *as, SpGistLevelStat *ls, Buffer buffer, int bufferSize)
+{
+	Page			page = BufferGetPage(buffer);
+	BlockNumber		blkno = BufferGetBlockNumber(buffer);
+	double			fill;
+
+	if (blkno < as->nPages)
+	{
+		if (as->seenPages[blkno])
+			return;
+		as->seenPages[blkno] = true;
+	}
+
+	fill = 1.0 - ((double) (PageGetFreeSpace(page) + sizeof(ItemIdData))) / bufferSize;
+
+	if (SpGistPageIsLeaf(page))
+	{
+		ls->leafPages++;
+		ls->leafFill += fill;
+	}
+	else
+	{
+		OffsetNumber	i;
+
+		ls->innerPages++;
+		ls->innerFill += fill;
+
+		for(i=FirstOffsetNumber; i<=SpGistPageGetMaxOffset(page); i++)
+			if (SpGistIsPlaceholder(page, i))
+				ls->placeholders++;
+	}
+}
+
+static void
+analyzeItem(Relation index, SpGistState *state, SpGistAnalyzeState *as,
+			SpGistAnalyzeItem *item, double sampleFrac, int bufferSize)
+{
+	Buffer			buffer;
+	Page			page;
+	OffsetNumber	maxoff;
+	SpGistLevelStat	*ls = getLevel(as, item->level);
+
+	buffer = ReadBuffer(index, item->blkno);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buffer);
+
+	if (PageIsNew(page) || SpGistPageIsDeleted(page))
+	{
+		UnlockReleaseBuffer(buffer);
+		return;
+	}
+
+	analyzePage(as, ls, buffer, bufferSize);
+	maxoff = SpGistPageGetMaxOffset(page);
+
+	if (SpGistPageIsLeaf(page))
+	{
+		int				length = 0;
+		OffsetNumber	offset = item->offset;
+
+		if (item->blkno == SPGIST_HEAD_BLKNO)
+		{
+			/* leaf root is a single chain of all its tuples */
+			length = maxoff;
+		}
+		else
+		{
+			while(offset != InvalidOffsetNumber && offset <= maxoff && length < maxoff)
+			{
+				length++;
+				offset = ((SpGistLeafTuple) PageGetItem(page, PageGetItemId(page, offset)))->nextOffset;
+			}
+		}
+
+		if (length > 0)
+		{
+			ls->leafChains++;
+			ls->leafTuples += length;
+			ls->maxChain = Max(ls->maxChain, length);
+			ls->chainHist[histBucket(length)]++;
+		}
+	}
+	else if (item->offset <= maxoff && !SpGistIsPlaceholder(page, item->offset))
+	{
+		SpGistInnerTuple	innerTuple;
+		IndexTuple			node;
+		int					i;
+
+		innerTuple = (SpGistInnerTuple) PageGetItem(page, PageGetItemId(page, item->offset));
+
+		ls->innerTuples++;
+		ls->nodes += innerTuple->nNodes;
+		ls->fanoutHist[histBucket(innerTuple->nNodes)]++;
+		if (innerTuple->hasPrefix)
+		{
+			ls->prefixes++;
+			ls->prefixBytes += getTypeLength(&state->attPrefixType,
+											 SGITDATUM(innerTuple, state));
+		}
+
+		SGITITERATE(innerTuple, state, i, node)
+		{
+			if (!ItemPointerIsValid(&node->t_tid))
+				continue;
+			if (sampleFrac < 1.0 && random() > sampleFrac * MAX_RANDOM_VALUE)
+				continue;
+
+			pushItem(as, ItemPointerGetBlockNumber(&node->t_tid),
+					 ItemPointerGetOffsetNumber(&node->t_tid), item->level + 1);
+		}
+	}
+
+	UnlockReleaseBuffer(buffer);
+}
+
+static Datum
+histArray(int64 *hist)
+{
+	Datum	elems[SPG_ANALYZE_NBUCKETS];
+	int		n = SPG_ANALYZE_NBUCKETS,
+			i;
+
+	/* cut trailing empty buckets */
+	while(n > 1 && hist[n - 1] == 0)
+		n--;
+
+	for(i=0; i<n; i++)
+		elems[i] = Int64GetDatum(hist[i]);
+
+	return PointerGetDatum(construct_array(elems, n, INT8OID,
+										   sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+}
+
+#define SPG_ANALYZE_NCOLUMNS	14
+
+PG_FUNCTION_INFO_V1(spg_analyze);
+Datum       spg_analyze(PG_FUNCTION_ARGS);
+Datum
+spg_analyze(PG_FUNCTION_ARGS)
+{
+	FuncCallContext		*funcctx;
+	SpGistAnalyzeState	*as;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		text			*name = PG_GETARG_TEXT_P(0);
+		double			samplePct = PG_GETARG_FLOAT8(1);
+		RangeVar   		*relvar;
+		Relation		index;
+		SpGistState		state;
+		TupleDesc		tupdesc;
+		MemoryContext	oldCtx;
+		int				bufferSize = BLCKSZ - MAXALIGN(sizeof(SpGistPageOpaqueData)) -
+										SizeOfPageHeaderData;
+
+		if (samplePct <= 0.0 || samplePct > 100.0)
+			elog(ERROR, "sample_pct must be in (0, 100]");
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldCtx = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		relvar = makeRangeVarFromNameList(stringToQualifiedNameList(text_to_cstring(name)));
+		index = index_open(RangeVarGetRelid(relvar, false), AccessShareLock);
+
+		if ( index->rd_am == NULL )
+			elog(ERROR, "Relation %s.%s is not an index",
+						get_namespace_name(RelationGetNamespace(index)),
+						RelationGetRelationName(index) );
+
+		initSpGistState(&state, index);
+
+		as = palloc0(sizeof(*as));
+		as->maxLevels = 16;
+		as->levels = palloc0(sizeof(SpGistLevelStat) * as->maxLevels);
+		as->maxStack = 64;
+		as->stack = palloc(sizeof(SpGistAnalyzeItem) * as->maxStack);
+		as->nPages = RelationGetNumberOfBlocks(index);
+		as->seenPages = palloc0(sizeof(bool) * as->nPages);
+
+		pushItem(as, SPGIST_HEAD_BLKNO, FirstOffsetNumber, 1);
+		while(as->nStack > 0)
+		{
+			SpGistAnalyzeItem	item = as->stack[--as->nStack];
+
+			analyzeItem(index, &state, as, &item, samplePct / 100.0, bufferSize);
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		index_close(index, AccessShareLock);
+
+		funcctx->user_fctx = as;
+		funcctx->max_calls = as->nLevels;
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	as = (SpGistAnalyzeState*) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		SpGistLevelStat	*ls = as->levels + funcctx->call_cntr;
+		Datum			values[SPG_ANALYZE_NCOLUMNS];
+		bool			nulls[SPG_ANALYZE_NCOLUMNS];
+		HeapTuple		tuple;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(funcctx->call_cntr + 1);
+		values[1] = Int64GetDatum(ls->innerTuples);
+		values[2] = Float8GetDatum((ls->innerTuples > 0) ?
+								   ((double) ls->nodes) / ls->innerTuples : 0.0);
+		values[3] = histArray(ls->fanoutHist);
+		values[4] = Float8GetDatum((ls->prefixes > 0) ?
+								   ((double) ls->prefixBytes) / ls->prefixes : 0.0);
+		values[5] = Int64GetDatum(ls->leafChains);
+		values[6] = Int64GetDatum(ls->leafTuples);
+		values[7] = Int32GetDatum(ls->maxChain);
+		values[8] = histArray(ls->chainHist);
+		values[9] = Int32GetDatum(ls->innerPages);
+		values[10] = Float8GetDatum((ls->innerPages > 0) ? ls->innerFill / ls->innerPages : 0.0);
+		values[11] = Int32GetDatum(ls->leafPages);
+		values[12] = Float8GetDatum((ls->leafPages > 0) ? ls->leafFill / ls->leafPages : 0.0);
+		values[13] = Int64GetDatum(ls->placeholders);
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
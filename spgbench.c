@@ -0,0 +1,407 @@
+#include "postgres.h"
+
+#include "access/heapam.h"
+#include "access/relscan.h"
+#include "access/skey.h"
+#include "catalog/namespace.h"
+#include "commands/defrem.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "nodes/memnodes.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/tuplestore.h"
+
+#include "spgist.h"
+
+/*
+ * spg_bench_opclass(opclass, dataset, iterations) calls the support
+ * functions of an SP-GiST operator class directly, without an index, on
+ * the values of the first column of the dataset table (for example
+ * data/point.data or data/text.data loaded into a table):
+ *
+ *	picksplit			once per iteration on all values, level 0
+ *	choose				for every value, on the inner tuple made by picksplit
+ *	inner_consistent	for every value as query, on the same inner tuple
+ *	leaf_consistent		for every value as query, on another value as leaf
+ *
+ * Queries use the lowest strategy of the operator family with both
+ * arguments of the indexed type. Support functions allocate in a context
+ * reset after every pass over the dataset. Its alloc and free methods are
+ * wrapped to count allocations and the high-water mark of allocated bytes
+ * (chunk space, as the allocator sees it) within one pass.
+ */
+
+typedef enum SpGistBenchFn
+{
+	SPG_BENCH_PICKSPLIT,
+	SPG_BENCH_CHOOSE,
+	SPG_BENCH_INNER_CONSISTENT,
+	SPG_BENCH_LEAF_CONSISTENT,
+	SPG_BENCH_NFN
+} SpGistBenchFn;
+
+static const char *benchFnNames[SPG_BENCH_NFN] = {
+	"picksplit",
+	"choose",
+	"inner_consistent",
+	"leaf_consistent"
+};
+
+typedef struct SpGistBenchResult
+{
+	int64		calls;
+	double		totalNs;
+	int64		allocs;
+	int64		peakBytes;
+} SpGistBenchResult;
+
+/*
+ * Counting wrapper of the allocator methods of the bench context
+ */
+static MemoryContextMethods	benchMethods;
+static MemoryContextMethods	*benchOrigMethods = NULL;
+static int64	benchAllocs;
+static int64	benchLiveBytes;
+static int64	benchPeakBytes;
+
+static void *
+benchAlloc(MemoryContext context, Size size)
+{
+	void	*pointer = benchOrigMethods->alloc(context, size);
+
+	benchAllocs++;
+	benchLiveBytes += benchOrigMethods->get_chunk_space(context, pointer);
+	benchPeakBytes = Max(benchPeakBytes, benchLiveBytes);
+
+	return pointer;
+}
+
+static void
+benchFree(MemoryContext context, void *pointer)
+{
+	benchLiveBytes -= benchOrigMethods->get_chunk_space(context, pointer);
+	benchOrigMethods->free_p(context, pointer);
+}
+
+static void *
+benchRealloc(MemoryContext context, void *pointer, Size size)
+{
+	benchLiveBytes -= benchOrigMethods->get_chunk_space(context, pointer);
+	pointer = benchOrigMethods->realloc(context, pointer, size);
+
+	benchAllocs++;
+	benchLiveBytes += benchOrigMethods->get_chunk_space(context, pointer);
+	benchPeakBytes = Max(benchPeakBytes, benchLiveBytes);
+
+	return pointer;
+}
+
+static void
+benchReset(MemoryContext context)
+{
+	benchLiveBytes = 0;
+	benchOrigMethods->reset(context);
+}
+
+static MemoryContext
+createBenchContext(void)
+{
+	MemoryContext	cxt;
+
+	cxt = AllocSetContextCreate(CurrentMemoryContext,
+								"SP-GiST opclass bench context",
+								ALLOCSET_DEFAULT_MINSIZE,
+								ALLOCSET_DEFAULT_INITSIZE,
+								ALLOCSET_DEFAULT_MAXSIZE);
+
+	benchOrigMethods = cxt->methods;
+	benchMethods = *cxt->methods;
+	benchMethods.alloc = benchAlloc;
+	benchMethods.free_p = benchFree;
+	benchMethods.realloc = benchRealloc;
+	benchMethods.reset = benchReset;
+	cxt->methods = &benchMethods;
+
+	return cxt;
+}
+
+/*
+ * Values of the first column of the table, skipping NULLs
+ */
+static Datum *
+loadDataset(char *relname, Oid type, int *nDatums)
+{
+	Relation		heap;
+	HeapScanDesc	scan;
+	HeapTuple		tuple;
+	Form_pg_attribute	att;
+	Datum			*datums;
+	int				n = 0,
+					maxDatums = 1024;
+
+	heap = heap_openrv(makeRangeVarFromNameList(stringToQualifiedNameList(relname)),
+					   AccessShareLock);
+
+	att = heap->rd_att->attrs[0];
+	if (att->atttypid != type)
+		elog(ERROR, "first column of \"%s\" must be of type %s",
+			 RelationGetRelationName(heap), format_type_be(type));
+
+	datums = palloc(sizeof(Datum) * maxDatums);
+
+	scan = heap_beginscan(heap, GetActiveSnapshot(), 0, NULL);
+	while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		bool	isnull;
+		Datum	value = heap_getattr(tuple, 1, heap->rd_att, &isnull);
+
+		if (isnull)
+			continue;
+
+		if (n >= maxDatums)
+		{
+			maxDatums *= 2;
+			datums = repalloc(datums, sizeof(Datum) * maxDatums);
+		}
+		datums[n++] = datumCopy(value, att->attbyval, att->attlen);
+	}
+	heap_endscan(scan);
+
+	heap_close(heap, AccessShareLock);
+
+	if (n == 0)
+		elog(ERROR, "dataset \"%s\" is empty", relname);
+
+	*nDatums = n;
+	return datums;
+}
+
+static void
+benchProc(Oid opfamily, Oid type, int procnum, FmgrInfo *flinfo)
+{
+	Oid		procOid = get_opfamily_proc(opfamily, type, type, procnum);
+
+	if (!OidIsValid(procOid))
+		elog(ERROR, "missing support function %d in operator family %u",
+			 procnum, opfamily);
+	fmgr_info(procOid, flinfo);
+}
+
+#define SPG_BENCH_MAX_STRATEGY	64
+#define SPG_BENCH_NCOLUMNS		5
+
+PG_FUNCTION_INFO_V1(spg_bench_opclass);
+Datum       spg_bench_opclass(PG_FUNCTION_ARGS);
+Datum
+spg_bench_opclass(PG_FUNCTION_ARGS)
+{
+	char				*opclassName = text_to_cstring(PG_GETARG_TEXT_P(0));
+	char				*relname = text_to_cstring(PG_GETARG_TEXT_P(1));
+	int32				iterations = PG_GETARG_INT32(2);
+	ReturnSetInfo		*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	Tuplestorestate		*tupstore;
+	MemoryContext		oldCtx,
+						benchCxt;
+	Oid					amOid,
+						opclassOid,
+						opfamily,
+						type;
+	SpGistOpClassProp	*prop;
+	FmgrInfo			procs[SPGISTNProc + 1];
+	StrategyNumber		strategy = InvalidStrategy;
+	Datum				*datums;
+	int					nDatums;
+	spgPickSplitIn		split;
+	spgPickSplitOut		splitOut;
+	ScanKeyData			key;
+	SpGistBenchResult	results[SPG_BENCH_NFN];
+	int					f, iter, i;
+
+	if (iterations < 1)
+		elog(ERROR, "number of iterations must be positive");
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		elog(ERROR, "set-valued function called in context that cannot accept a set");
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	amOid = GetSysCacheOid1(AMNAME, CStringGetDatum("spgist"));
+	if (!OidIsValid(amOid))
+		elog(ERROR, "access method \"spgist\" does not exist");
+	opclassOid = get_opclass_oid(amOid, stringToQualifiedNameList(opclassName), false);
+	opfamily = get_opclass_family(opclassOid);
+	type = get_opclass_input_type(opclassOid);
+
+	for(i=1; i<=SPGISTNProc; i++)
+		benchProc(opfamily, type, i, &procs[i]);
+
+	for(i=1; i<=SPG_BENCH_MAX_STRATEGY && strategy == InvalidStrategy; i++)
+		if (OidIsValid(get_opfamily_member(opfamily, type, type, i)))
+			strategy = i;
+	if (strategy == InvalidStrategy)
+		elog(ERROR, "operator class \"%s\" has no operator on %s",
+			 opclassName, format_type_be(type));
+
+	prop = (SpGistOpClassProp*) DatumGetPointer(
+				OidFunctionCall0Coll(procs[SPGIST_PROP_PROC].fn_oid, InvalidOid));
+	datums = loadDataset(relname, prop->leafType, &nDatums);
+
+	/* the inner tuple used by choose and inner_consistent */
+	split.nTuples = nDatums;
+	split.datums = datums;
+	split.level = 0;
+	memset(&splitOut, 0, sizeof(splitOut));
+	FunctionCall2(&procs[SPGIST_PICKSPLIT_PROC],
+				  PointerGetDatum(&split), PointerGetDatum(&splitOut));
+
+	memset(&key, 0, sizeof(key));
+	key.sk_attno = 1;
+	key.sk_strategy = strategy;
+	key.sk_subtype = type;
+
+	memset(results, 0, sizeof(results));
+	benchCxt = createBenchContext();
+
+	for(f=0; f<SPG_BENCH_NFN; f++)
+	{
+		instr_time	start,
+					duration;
+
+		benchAllocs = 0;
+		benchPeakBytes = 0;
+
+		INSTR_TIME_SET_CURRENT(start);
+		oldCtx = MemoryContextSwitchTo(benchCxt);
+
+		for(iter=0; iter<iterations; iter++)
+		{
+			int		nOps = (f == SPG_BENCH_PICKSPLIT) ? 1 : nDatums;
+
+			for(i=0; i<nOps; i++)
+			{
+				switch(f)
+				{
+					case SPG_BENCH_PICKSPLIT:
+						{
+							spgPickSplitOut	out;
+
+							FunctionCall2(&procs[SPGIST_PICKSPLIT_PROC],
+										  PointerGetDatum(&split),
+										  PointerGetDatum(&out));
+						}
+						break;
+					case SPG_BENCH_CHOOSE:
+						{
+							spgChooseIn		in;
+							spgChooseOut	out;
+
+							in.datum = datums[i];
+							in.level = 0;
+							in.hasPrefix = splitOut.hasPrefix;
+							in.prefixDatum = splitOut.prefixDatum;
+							in.nNodes = splitOut.nNodes;
+							in.nodeDatums = splitOut.nodeDatums;
+
+							FunctionCall2(&procs[SPGIST_CHOOSE_PROC],
+										  PointerGetDatum(&in),
+										  PointerGetDatum(&out));
+						}
+						break;
+					case SPG_BENCH_INNER_CONSISTENT:
+						{
+							spgInnerConsistentIn	in;
+							spgInnerConsistentOut	out;
+
+							key.sk_argument = datums[i];
+
+							in.scankeys = &key;
+							in.nkeys = 1;
+							in.orderbys = NULL;
+							in.norderbys = 0;
+							in.level = 0;
+							in.traversalValue = NULL;
+							in.traversalMemoryContext = benchCxt;
+							in.hasPrefix = splitOut.hasPrefix;
+							in.prefixDatum = splitOut.prefixDatum;
+							in.nNodes = splitOut.nNodes;
+							in.nodeDatums = splitOut.nodeDatums;
+							out.traversalValues = NULL;
+							out.distances = NULL;
+
+							FunctionCall2(&procs[SPGIST_INNERCONS_PROC],
+										  PointerGetDatum(&in),
+										  PointerGetDatum(&out));
+						}
+						break;
+					case SPG_BENCH_LEAF_CONSISTENT:
+						{
+							spgLeafConsistentIn		in;
+							spgLeafConsistentOut	out;
+
+							key.sk_argument = datums[i];
+
+							in.scankeys = &key;
+							in.nkeys = 1;
+							in.orderbys = NULL;
+							in.norderbys = 0;
+							in.level = 0;
+							in.traversalValue = NULL;
+							in.leafDatum = datums[(i + nDatums / 2) % nDatums];
+							out.recheck = false;
+							out.distance = 0.0;
+
+							FunctionCall2(&procs[SPGIST_LEAFCONS_PROC],
+										  PointerGetDatum(&in),
+										  PointerGetDatum(&out));
+						}
+						break;
+				}
+			}
+
+			results[f].calls += nOps;
+			MemoryContextReset(benchCxt);
+		}
+
+		MemoryContextSwitchTo(oldCtx);
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+
+		results[f].totalNs = INSTR_TIME_GET_DOUBLE(duration) * 1e9;
+		results[f].allocs = benchAllocs;
+		results[f].peakBytes = benchPeakBytes;
+	}
+
+	MemoryContextDelete(benchCxt);
+
+	oldCtx = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = CreateTupleDescCopy(tupdesc);
+	MemoryContextSwitchTo(oldCtx);
+
+	for(f=0; f<SPG_BENCH_NFN; f++)
+	{
+		Datum		values[SPG_BENCH_NCOLUMNS];
+		bool		nulls[SPG_BENCH_NCOLUMNS];
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = CStringGetTextDatum(benchFnNames[f]);
+		values[1] = Int64GetDatum(results[f].calls);
+		values[2] = Float8GetDatum(results[f].totalNs / results[f].calls);
+		values[3] = Float8GetDatum(((double) results[f].allocs) / results[f].calls);
+		values[4] = Int64GetDatum(results[f].peakBytes);
+
+		tuplestore_putvalues(tupstore, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
@@ -0,0 +1,350 @@
+#include "postgres.h"
+
+#include "storage/bufmgr.h"
+#include "utils/datum.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+#include "spgist.h"
+
+/*
+ * Backend-local cache of the upper levels of the tree.
+ *
+ * With spgist.cache_levels > 0 inner tuples of that many levels below the
+ * root (at most SPGIST_CACHE_MAX_TUPLES of them, breadth first) are kept
+ * decoded: prefix, labels and child pointers in flat arrays. Inserts run
+ * choose on the cached tuples and start the usual descent from the deepest
+ * one reached, scans call inner_consistent on cached tuples without
+ * touching their pages.
+ *
+ * Validity is checked against upperVersion of the metapage. Inserts bump it
+ * when they change an inner tuple of the top SPGIST_CACHE_MAX_LEVELS levels
+ * (whatever the local setting is) while still holding the lock on its page:
+ * addNode, splitTuple or a new inner tuple made by picksplit. A move by
+ * addNode changes the link in the parent, so it bumps one level deeper,
+ * the links of the lowest cached tuples are cached too. Links to leaf chains change when chains are created and are
+ * not covered, so a cached tuple is used by scans only if all its children
+ * are inner tuples, and inserts read the tuple they start from in its page.
+ *
+ * An insert checks the version after locking the page it starts from, so
+ * it never starts from a tuple moved away. A scan checks it once at start,
+ * later changes may be missed by it like by any scan holding a child
+ * pointer in its queue.
+ */
+
+int		spgist_cache_levels = 0;
+
+typedef struct SpGistUpperCache
+{
+	Oid					indexOid;
+	Oid					relNode;	/* changed by REINDEX */
+	bool				valid;
+	uint32				version;	/* upperVersion the cache was built at */
+	int					nLevels;
+	MemoryContext		cxt;
+	SpGistCachedInner	*root;		/* NULL if root is a leaf page */
+} SpGistUpperCache;
+
+static HTAB *upperCacheHash = NULL;
+
+static SpGistUpperCache *
+getUpperCache(Relation index)
+{
+	Oid					indexOid = RelationGetRelid(index);
+	SpGistUpperCache	*cache;
+	bool				found;
+
+	if (upperCacheHash == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(SpGistUpperCache);
+		ctl.hash = oid_hash;
+		upperCacheHash = hash_create("SP-GiST upper levels cache", 16, &ctl,
+									 HASH_ELEM | HASH_FUNCTION);
+	}
+
+	cache = (SpGistUpperCache*) hash_search(upperCacheHash, &indexOid,
+											HASH_ENTER, &found);
+	if (!found)
+	{
+		cache->valid = false;
+		cache->root = NULL;
+		cache->cxt = AllocSetContextCreate(CacheMemoryContext,
+										   "SP-GiST upper levels cache",
+										   ALLOCSET_SMALL_MINSIZE,
+										   ALLOCSET_SMALL_INITSIZE,
+										   ALLOCSET_DEFAULT_MAXSIZE);
+	}
+
+	return cache;
+}
+
+static uint32
+readUpperVersion(Relation index)
+{
+	Buffer	buffer;
+	uint32	version;
+
+	buffer = ReadBuffer(index, SPGIST_METAPAGE_BLKNO);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	version = SpGistPageGetMeta(BufferGetPage(buffer))->upperVersion;
+	UnlockReleaseBuffer(buffer);
+
+	return version;
+}
+
+/*
+ * Decode inner tuple at blkno/offset into cxt. Returns NULL and sets
+ * *isInner to false if there is no inner tuple, with decode false only
+ * checks that.
+ */
+static SpGistCachedInner *
+cacheInner(Relation index, SpGistState *state, MemoryContext cxt,
+		   BlockNumber blkno, OffsetNumber offset, bool decode, bool *isInner)
+{
+	Buffer				buffer;
+	Page				page;
+	SpGistInnerTuple	innerTuple;
+	SpGistCachedInner	*cached = NULL;
+
+	buffer = ReadBuffer(index, blkno);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buffer);
+
+	*isInner = false;
+	if (PageIsNew(page) || SpGistPageIsDeleted(page) || SpGistPageIsLeaf(page) ||
+		offset > SpGistPageGetMaxOffset(page))
+	{
+		UnlockReleaseBuffer(buffer);
+		return NULL;
+	}
+
+	innerTuple = (SpGistInnerTuple) PageGetItem(page, PageGetItemId(page, offset));
+	/* placeholder left by addNode */
+	*isInner = (innerTuple->size != 0);
+
+	if (*isInner && decode)
+	{
+		MemoryContext	oldCtx = MemoryContextSwitchTo(cxt);
+		IndexTuple		node;
+		int				i;
+
+		cached = palloc0(sizeof(*cached));
+		cached->blkno = blkno;
+		cached->offset = offset;
+		cached->hasPrefix = innerTuple->hasPrefix;
+		if (cached->hasPrefix)
+			cached->prefixDatum = datumCopy(SGITDATUM(innerTuple, state),
+											state->attPrefixType.attbyval,
+											state->attPrefixType.attlen);
+		cached->nNodes = innerTuple->nNodes;
+		cached->nodeDatums = palloc(sizeof(Datum) * cached->nNodes);
+		cached->childPtrs = palloc(sizeof(ItemPointerData) * cached->nNodes);
+		cached->children = palloc0(sizeof(SpGistCachedInner*) * cached->nNodes);
+
+		SGITITERATE(innerTuple, state, i, node)
+		{
+			bool	isnull;
+			Datum	label = index_getattr(node, 1, state->nodeTupDesc, &isnull);
+
+			cached->nodeDatums[i] = (isnull) ? label :
+				datumCopy(label, state->attNodeType.attbyval, state->attNodeType.attlen);
+			cached->childPtrs[i] = node->t_tid;
+		}
+
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	UnlockReleaseBuffer(buffer);
+
+	return cached;
+}
+
+static void
+buildUpperCache(Relation index, SpGistState *state, SpGistUpperCache *cache)
+{
+	SpGistCachedInner	**current,
+						**next;
+	int					nCurrent,
+						nNext,
+						nTuples,
+						d, i, j;
+	bool				isInner;
+
+	MemoryContextReset(cache->cxt);
+
+	cache->root = cacheInner(index, state, cache->cxt,
+							 SPGIST_HEAD_BLKNO, FirstOffsetNumber, true, &isInner);
+	if (cache->root == NULL)
+		return;
+
+	current = palloc(sizeof(SpGistCachedInner*) * SPGIST_CACHE_MAX_TUPLES);
+	next = palloc(sizeof(SpGistCachedInner*) * SPGIST_CACHE_MAX_TUPLES);
+	current[0] = cache->root;
+	nCurrent = nTuples = 1;
+
+	for(d=0; d<cache->nLevels && nCurrent > 0; d++)
+	{
+		SpGistCachedInner	**tmp;
+
+		nNext = 0;
+		for(i=0; i<nCurrent; i++)
+		{
+			SpGistCachedInner	*cached = current[i];
+
+			cached->allInner = true;
+			for(j=0; j<cached->nNodes; j++)
+			{
+				ItemPointer			ptr = cached->childPtrs + j;
+				bool				decode;
+
+				if (!ItemPointerIsValid(ptr))
+				{
+					cached->allInner = false;
+					continue;
+				}
+
+				decode = (d + 1 < cache->nLevels && nTuples < SPGIST_CACHE_MAX_TUPLES);
+				cached->children[j] = cacheInner(index, state, cache->cxt,
+												 ItemPointerGetBlockNumber(ptr),
+												 ItemPointerGetOffsetNumber(ptr),
+												 decode, &isInner);
+				if (!isInner)
+					cached->allInner = false;
+				if (cached->children[j])
+				{
+					next[nNext++] = cached->children[j];
+					nTuples++;
+				}
+			}
+		}
+
+		tmp = current;
+		current = next;
+		next = tmp;
+		nCurrent = nNext;
+	}
+
+	pfree(current);
+	pfree(next);
+}
+
+/*
+ * Root of the cache, rebuilt if needed. Without check the version is not
+ * read, caller must check it by spgUpperCacheIsValid() before relying on
+ * the result. NULL if the cache is disabled or the root is a leaf page.
+ */
+SpGistCachedInner *
+spgGetUpperCache(Relation index, SpGistState *state, bool check)
+{
+	SpGistUpperCache	*cache;
+	uint32				version;
+
+	if (spgist_cache_levels <= 0)
+		return NULL;
+
+	cache = getUpperCache(index);
+
+	if (cache->valid && cache->relNode == index->rd_node.relNode &&
+		cache->nLevels == spgist_cache_levels)
+	{
+		if (!check)
+			return cache->root;
+		version = readUpperVersion(index);
+		if (version == cache->version)
+			return cache->root;
+	}
+	else
+		version = readUpperVersion(index);
+
+	/* version is read first, so changes made during the build invalidate it */
+	cache->valid = false;
+	cache->version = version;
+	cache->relNode = index->rd_node.relNode;
+	cache->nLevels = spgist_cache_levels;
+	buildUpperCache(index, state, cache);
+	cache->valid = true;
+
+	return cache->root;
+}
+
+bool
+spgUpperCacheIsValid(Relation index)
+{
+	SpGistUpperCache	*cache = getUpperCache(index);
+
+	if (cache->valid && cache->version != readUpperVersion(index))
+		cache->valid = false;
+
+	return cache->valid;
+}
+
+/*
+ * Called with the changed inner tuple's page locked. WAL-logged for caches
+ * of standby backends.
+ */
+void
+spgBumpUpperVersion(Relation index, SpGistState *state)
+{
+	Buffer				buffer;
+	SpGistMetaPageData	*metaData;
+
+	buffer = ReadBuffer(index, SPGIST_METAPAGE_BLKNO);
+	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+	metaData = SpGistPageGetMeta(BufferGetPage(buffer));
+	metaData->upperVersion++;
+	MarkBufferDirty(buffer);
+	spgLogPage(index, state, buffer);
+	UnlockReleaseBuffer(buffer);
+}
+
+/*
+ * Run choose on cached tuples while it matches a node, and return the
+ * location, level and depth of the deepest cached tuple where it did.
+ * choose gives the same answer there again, so the insert starting from it
+ * never has to change it, which would need its parent locked. Returns false
+ * if there is nothing to skip.
+ */
+bool
+spgCacheDescend(Relation index, SpGistState *state, Datum datum,
+				BlockNumber *blkno, OffsetNumber *offset, int *level, int *depth)
+{
+	SpGistCachedInner	*cached = spgGetUpperCache(index, state, false),
+						*start = NULL;
+	int					l = 0,
+						d = 0;
+
+	while(cached)
+	{
+		spgChooseIn		in;
+		spgChooseOut	out;
+
+		in.datum = datum;
+		in.level = l;
+		in.hasPrefix = cached->hasPrefix;
+		in.prefixDatum = cached->prefixDatum;
+		in.nNodes = cached->nNodes;
+		in.nodeDatums = cached->nodeDatums;
+
+		FunctionCall2(&state->chooseFn, PointerGetDatum(&in), PointerGetDatum(&out));
+
+		if (out.resultType != spgMatchNode)
+			break;
+
+		start = cached;
+		*blkno = cached->blkno;
+		*offset = cached->offset;
+		*level = l;
+		*depth = d;
+
+		cached = cached->children[out.result.matchNode.nodeN];
+		l += out.result.matchNode.levelAdd;
+		d++;
+	}
+
+	return (start != NULL && *depth > 0);
+}
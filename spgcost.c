@@ -1,29 +1,149 @@
 #include "postgres.h"
 
+#include <math.h>
+
 #include "fmgr.h"
+#include "access/genam.h"
+#include "nodes/relation.h"
 #include "optimizer/cost.h"
 #include "utils/selfuncs.h"
 
 #include "spgist.h"
 
+/*
+ * Cost of an SP-GiST scan from the tree shape kept in the metapage.
+ *
+ * Matching tuples are found in leaf chains of avgChain tuples each, and a
+ * chain is examined completely once reached. Reaching the first chain costs
+ * a descent of maxDepth inner tuples, every further one about one inner
+ * tuple per (fanout - 1) chains. Chains are spread over leaf pages, so each
+ * chain is counted as a separate page fetch. The selectivity comes from the
+ * restriction estimators of the operators, which are the per-opclass part
+ * of the estimate: for lookups (~=, =) it is below one chain and the cost
+ * collapses to a single descent, for prefix and box scans it grows with the
+ * number of chains.
+ *
+ * Shape is scaled to the current index size, since metapage statistics are
+ * refreshed only by build and vacuum. An empty index has exact statistics
+ * too. Only an index of an old format, whose metapage has none and which
+ * fails anyway until REINDEX, gets the GiST estimate.
+ */
 PG_FUNCTION_INFO_V1(spgcostestimate);
 Datum       spgcostestimate(PG_FUNCTION_ARGS);
 Datum
 spgcostestimate(PG_FUNCTION_ARGS)
 {
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	IndexOptInfo *index = (IndexOptInfo *) PG_GETARG_POINTER(1);
+	List	   *indexQuals = (List *) PG_GETARG_POINTER(2);
+	List	   *indexOrderBys = (List *) PG_GETARG_POINTER(3);
+	RelOptInfo *outer_rel = (RelOptInfo *) PG_GETARG_POINTER(4);
+	Cost	   *indexStartupCost = (Cost *) PG_GETARG_POINTER(5);
+	Cost	   *indexTotalCost = (Cost *) PG_GETARG_POINTER(6);
+	Selectivity *indexSelectivity = (Selectivity *) PG_GETARG_POINTER(7);
+	double	   *indexCorrelation = (double *) PG_GETARG_POINTER(8);
+	Relation	indexRel;
+	SpGistStats	stats;
+	bool		current;
+	double		numIndexTuples,
+				numSaScans = 1.0,
+				numPages = Max(index->pages, 1),
+				innerPages,
+				leafPages,
+				fanout,
+				avgChain,
+				chains,
+				innerVisited,
+				pagesFetched;
+	QualCost	qualCost;
+	ListCell   *l;
+
+	indexRel = index_open(index->indexoid, AccessShareLock);
+	current = spgFormatIsCurrent(indexRel);
+	if (current)
+		spgGetStats(indexRel, &stats);
+	index_close(indexRel, AccessShareLock);
+
+	if (!current)
+	{
+		DirectFunctionCall9(
+			gistcostestimate,
+			PG_GETARG_DATUM(0),
+			PG_GETARG_DATUM(1),
+			PG_GETARG_DATUM(2),
+			PG_GETARG_DATUM(3),
+			PG_GETARG_DATUM(4),
+			PG_GETARG_DATUM(5),
+			PG_GETARG_DATUM(6),
+			PG_GETARG_DATUM(7),
+			PG_GETARG_DATUM(8)
+		);
+
+		PG_RETURN_VOID();
+	}
+
+	*indexSelectivity = clauselist_selectivity(root, indexQuals,
+											   index->rel->relid,
+											   JOIN_INNER, NULL);
+
+	/* = ANY(array) is executed as one descent per element */
+	foreach(l, indexQuals)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(l);
+
+		if (IsA(rinfo->clause, ScalarArrayOpExpr))
+			numSaScans *= estimate_array_length(lsecond(((ScalarArrayOpExpr *) rinfo->clause)->args));
+	}
+
+	numIndexTuples = clamp_row_est(*indexSelectivity * index->tuples);
+
+	leafPages = (stats.nLeafPages + stats.nInnerPages > 0) ?
+				numPages * ((double) stats.nLeafPages) /
+				((double) (stats.nLeafPages + stats.nInnerPages)) : numPages;
+	innerPages = numPages - leafPages;
+	fanout = (stats.nInnerTuples > 0) ?
+				((double) stats.nNodes) / ((double) stats.nInnerTuples) : 1.0;
+	avgChain = (stats.nChains > 0) ?
+				((double) stats.nLeafTuples) / ((double) stats.nChains) : 1.0;
+
+	chains = Max(ceil(numIndexTuples / (avgChain * numSaScans)), 1.0) * numSaScans;
+	innerVisited = (stats.maxDepth + 1) * numSaScans +
+				   chains / Max(fanout - 1.0, 1.0);
+
+	pagesFetched = Min(chains, Max(leafPages, 1.0)) +
+				   Min(innerVisited, Max(innerPages, 1.0));
+
+	if (outer_rel != NULL && outer_rel->rows > 1)
+	{
+		double		numOuterScans = outer_rel->rows;
+
+		pagesFetched = index_pages_fetched(pagesFetched * numOuterScans,
+										   index->pages,
+										   (double) index->pages,
+										   root);
+		*indexTotalCost = (pagesFetched * random_page_cost) / numOuterScans;
+	}
+	else
+		*indexTotalCost = pagesFetched * random_page_cost;
+
+	/*
+	 * inner_consistent checks every node of a visited inner tuple against
+	 * every qual, leaf_consistent every tuple of a reached chain
+	 */
+	cost_qual_eval(&qualCost, indexQuals, root);
+	qualCost.per_tuple = Max(qualCost.per_tuple, cpu_operator_cost);
+
+	*indexStartupCost = qualCost.startup;
+	*indexTotalCost += qualCost.startup +
+		innerVisited * fanout * qualCost.per_tuple +
+		chains * avgChain * (cpu_index_tuple_cost + qualCost.per_tuple);
+
+	/* ordered scans keep a heap of pending items */
+	if (indexOrderBys != NIL)
+		*indexTotalCost += (innerVisited * fanout + numIndexTuples) *
+			cpu_operator_cost * Max(log(numIndexTuples + fanout) / log(2.0), 1.0);
 
-	DirectFunctionCall9(
-		gistcostestimate,
-		PG_GETARG_DATUM(0),
-		PG_GETARG_DATUM(1),
-		PG_GETARG_DATUM(2),
-		PG_GETARG_DATUM(3),
-		PG_GETARG_DATUM(4),
-		PG_GETARG_DATUM(5),
-		PG_GETARG_DATUM(6),
-		PG_GETARG_DATUM(7),
-		PG_GETARG_DATUM(8)
-	);
+	*indexCorrelation = 0.0;
 
 	PG_RETURN_VOID();
 }
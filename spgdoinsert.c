@@ -1,6 +1,7 @@
 #include "postgres.h"
 
 #include "access/genam.h"
+#include "access/transam.h"
 #include "catalog/index.h"
 #include "miscadmin.h"
 #include "storage/bufmgr.h"
@@ -37,44 +38,89 @@ cmpOffsetNumbers(const void *a, const void *b)
 	return ( *(OffsetNumber*)a > *(OffsetNumber*)b ) ? 1 : -1;
 }
 
-static void
-doPickSplit(Relation index, SpGistState *state, Buffer buffer,  
-			Buffer parentBuffer, BlockNumber *blkno /* out */, OffsetNumber *offset /* in/out */)
+static int
+chainLength(Page page, OffsetNumber offset)
 {
-	spgPickSplitIn		in;
-	spgPickSplitOut 	out;
-	int					i = *offset, n = 0;
-	Page				page = BufferGetPage(buffer);
-	SpGistInnerTuple	innerTuple;
-	IndexTuple			*nodes;
-	Buffer				*leafBuffers;
-	ItemPointerData		*heapPtrs;
+	int		n = 0;
 
-	while( i != InvalidOffsetNumber )
+	while( offset != InvalidOffsetNumber )
 	{
-		SpGistLeafTuple	it = (SpGistLeafTuple) PageGetItem(page, PageGetItemId(page, i));
+		SpGistLeafTuple	it = (SpGistLeafTuple) PageGetItem(page, PageGetItemId(page, offset));
 
 		n++;
-		i = it->nextOffset;
+		offset = it->nextOffset;
 	}
 
-	heapPtrs = palloc(sizeof(ItemPointerData) * SpGistPageGetMaxOffset(page));
-	in.datums = palloc(sizeof(Datum) * SpGistPageGetMaxOffset(page));
+	return n;
+}
 
-	i = *offset;
-	n = 0;
+/*
+ * Split the leaf chain starting at offset, or all tuples of the root leaf
+ * page if there is no parent. If optional, nothing is changed and false is
+ * returned when picksplit puts all tuples into one node, such a split would
+ * not make the chain any shorter. If the split is needed because the page
+ * is full, that is an error.
+ *
+ * Every changed page is WAL-logged as a whole, so every prefix of the
+ * records must be a consistent tree: new leaf pages and a new inner page
+ * are written while nothing points to them, then one write of the parent
+ * page (or of the root page) switches to them. The old leaf page is only
+ * marked deleted afterwards and keeps its tuples. Pages are allocated
+ * before the first change.
+ */
+static bool
+doPickSplit(Relation index, SpGistState *state, Buffer buffer, int level,
+			Buffer parentBuffer, OffsetNumber parentOffset, int parentNode,
+			OffsetNumber offset, bool optional)
+{
+	spgPickSplitIn		in;
+	spgPickSplitOut 	out;
+	Page				page = BufferGetPage(buffer);
+	int					maxTuples = SpGistPageGetMaxOffset(page),
+						i, n;
+	SpGistLeafTuple		it,
+						*leafTuples;
+	SpGistInnerTuple	innerTuple;
+	IndexTuple			*nodes;
+	int					*nodeTuples;
+	Buffer				*leafBuffers,
+						innerBuffer;
+	ItemPointerData		*heapPtrs,
+						*heads;
+	OffsetNumber		innerOffset;
+	TransactionId		deleteXid = InvalidTransactionId;
+	SpGistStats			change;
+
+	memset(&change, 0, sizeof(change));
+	heapPtrs = palloc(sizeof(ItemPointerData) * maxTuples);
+	in.datums = palloc(sizeof(Datum) * maxTuples);
 
-	while( i != InvalidOffsetNumber )
+	n = 0;
+	if (parentBuffer == InvalidBuffer)
 	{
-		SpGistLeafTuple	it = (SpGistLeafTuple) PageGetItem(page, PageGetItemId(page, i));
-	
-		in.datums[n] = SGLTDATUM(it, state);
-		heapPtrs[n] = it->heapPtr; 
-
-		n++;
-		i = it->nextOffset;
+		/* root leaf page is a single chain of all its tuples */
+		for(i=FirstOffsetNumber; i<=maxTuples; i++)
+		{
+			it = (SpGistLeafTuple) PageGetItem(page, PageGetItemId(page, i));
+			in.datums[n] = SGLTDATUM(it, state);
+			heapPtrs[n++] = it->heapPtr;
+		}
+	}
+	else
+	{
+		for(i=offset; i!=InvalidOffsetNumber; i=it->nextOffset)
+		{
+			it = (SpGistLeafTuple) PageGetItem(page, PageGetItemId(page, i));
+			in.datums[n] = SGLTDATUM(it, state);
+			heapPtrs[n++] = it->heapPtr;
+		}
 	}
 	in.nTuples = n;
+	in.level = level;
+
+	/* a single tuple can't be split, let it stay a chain */
+	if (optional && n < 2)
+		return false;
 
 	FunctionCall2(
 		&state->picksplitFn,
@@ -82,112 +128,247 @@ doPickSplit(Relation index, SpGistState *state, Buffer buffer,
 		PointerGetDatum(&out)
 	);
 
-	nodes = palloc(sizeof(IndexTuple) * in.nTuples);
-	leafBuffers = palloc(sizeof(Buffer) * in.nTuples);
+	for(i=1; i<in.nTuples; i++)
+		if (out.mapTuplesToNodes[i] != out.mapTuplesToNodes[0])
+			break;
+	if (i >= in.nTuples)
+	{
+		if (optional)
+			return false;
+		elog(ERROR, "picksplit of SP-GiST index \"%s\" put all %d tuples of a full page into one node",
+			 RelationGetRelationName(index), in.nTuples);
+	}
+
+	nodes = palloc(sizeof(IndexTuple) * out.nNodes);
+	nodeTuples = palloc0(sizeof(int) * out.nNodes);
+	heads = palloc(sizeof(ItemPointerData) * out.nNodes);
+	leafBuffers = palloc(sizeof(Buffer) * out.nNodes);
+	leafTuples = palloc(sizeof(SpGistLeafTuple) * in.nTuples);
+
 	for(i=0; i<out.nNodes; i++)
 	{
 		bool	isnull = false;
 
 		nodes[i] = index_form_tuple(state->nodeTupDesc, out.nodeDatums + i, &isnull);
 		ItemPointerSetInvalid(&nodes[i]->t_tid);
+		ItemPointerSetInvalid(&heads[i]);
 	}
 
+	for(i=0; i<in.nTuples; i++)
+	{
+		leafTuples[i] = spgFormLeafTuple(state, heapPtrs + i, out.leafTupleDatums[i]);
+		nodeTuples[out.mapTuplesToNodes[i]]++;
+	}
+
+	/* links are set after the leaf tuples are placed, size is known now */
+	innerTuple = spgFormInnerTuple(state,
+									out.hasPrefix, out.prefixDatum,
+									out.nNodes, nodes);
+
+	/* nodes without tuples stay unlinked */
 	for(i=0; i<out.nNodes; i++)
 	{
-		if (i==0 && BufferGetBlockNumber(buffer) != SPGIST_HEAD_BLKNO)
-			leafBuffers[i] = buffer;
-		else
-			leafBuffers[i] = SpGistNewBuffer(index);
+		leafBuffers[i] = InvalidBuffer;
+		if (nodeTuples[i] > 0)
+		{
+			leafBuffers[i] = SpGistNewBuffer(index, !state->bulkBuild);
+			change.nLeafPages++;
+		}
+	}
 
-		SpGistInitBuffer(leafBuffers[i], SPGIST_LEAF);
+	/* the old leaf page is deleted, or the root becomes an inner page */
+	if (parentBuffer != InvalidBuffer)
+		deleteXid = ReadNewTransactionId();
+	change.nLeafPages--;
+	if (parentBuffer == InvalidBuffer)
+	{
+		Assert(BufferGetBlockNumber(buffer) == SPGIST_HEAD_BLKNO);
+		innerBuffer = buffer;
+		change.nInnerPages++;
 	}
+	else if (BufferGetBlockNumber(parentBuffer) != SPGIST_HEAD_BLKNO &&
+			 PageGetFreeSpace(BufferGetPage(parentBuffer)) >= MAXALIGN(innerTuple->size) +
+															  MAXALIGN(sizeof(ItemIdData)) +
+															  state->innerFreeSpace)
+		innerBuffer = parentBuffer;
+	else
+	{
+		/* XXX choose inner page with free space */
+		innerBuffer = SpGistNewBuffer(index, !state->bulkBuild);
+		change.nInnerPages++;
+	}
+
+	/* the split chain is replaced by chains of non-empty nodes */
+	change.nSplits++;
+	if (parentBuffer != InvalidBuffer)
+		change.nChains--;
+	change.nInnerTuples++;
+	change.nNodes += out.nNodes;
+
+	START_CRIT_SECTION();
+
+	for(i=0; i<out.nNodes; i++)
+		if (leafBuffers[i] != InvalidBuffer)
+			SpGistInitBuffer(leafBuffers[i], SPGIST_LEAF);
 
 	for(i=0; i<in.nTuples; i++)
 	{
 		OffsetNumber	newoffset;
-		SpGistLeafTuple	it;
 
 		n = out.mapTuplesToNodes[i];
-		it = spgFormLeafTuple(state, heapPtrs + i, out.leafTupleDatums[i]);
+		it = leafTuples[i];
 
-		it->nextOffset = (ItemPointerIsValid(&nodes[n]->t_tid)) ? 
-					ItemPointerGetOffsetNumber(&nodes[n]->t_tid) : InvalidOffsetNumber;
+		it->nextOffset = (ItemPointerIsValid(&heads[n])) ? 
+					ItemPointerGetOffsetNumber(&heads[n]) : InvalidOffsetNumber;
 
-		newoffset = PageAddItem(BufferGetPage(leafBuffers[n]), (Item)it, it->size,
+		newoffset = PageAddItem(BufferGetPage(leafBuffers[n]), (Item)it, SGLTSIZE(it, state),
 								 InvalidOffsetNumber, false, false);
+		if (newoffset == InvalidOffsetNumber)
+			elog(ERROR, "failed to add leaf tuple to SP-GiST index \"%s\"",
+				 RelationGetRelationName(index));
 
-		ItemPointerSet(&nodes[n]->t_tid, 
-						BufferGetBlockNumber(leafBuffers[n]), newoffset);
+		ItemPointerSet(&heads[n], BufferGetBlockNumber(leafBuffers[n]), newoffset);
 	}
 
 	for(i=0; i<out.nNodes; i++)
 	{
-		if (leafBuffers[i] != buffer)
-		{
-			MarkBufferDirty(leafBuffers[i]);
-			UnlockReleaseBuffer(leafBuffers[i]);
-		}
+		if (leafBuffers[i] == InvalidBuffer)
+			continue;
+
+		MarkBufferDirty(leafBuffers[i]);
+		spgLogPage(index, state, leafBuffers[i]);
+
+		updateNodeLink(state, innerTuple, i,
+					   ItemPointerGetBlockNumber(&heads[i]),
+					   ItemPointerGetOffsetNumber(&heads[i]));
+		change.nChains++;
 	}
 
-	innerTuple = spgFormInnerTuple(state,
-									out.hasPrefix, out.prefixDatum,
-									out.nNodes, nodes);
+	if (innerBuffer != parentBuffer)
+	{
+		/* new inner page, or the root page */
+		SpGistInitBuffer(innerBuffer, 0);
+		innerOffset = PageAddItem(BufferGetPage(innerBuffer), (Item)innerTuple, innerTuple->size,
+								  InvalidOffsetNumber, false, false);
+		MarkBufferDirty(innerBuffer);
+		spgLogPage(index, state, innerBuffer);
+	}
 
-	if (parentBuffer != InvalidBuffer && BufferGetBlockNumber(parentBuffer) != SPGIST_HEAD_BLKNO && 
-			PageGetFreeSpace(BufferGetPage(parentBuffer)) >= MAXALIGN(innerTuple->size) + MAXALIGN(sizeof(ItemIdData)))
+	if (parentBuffer != InvalidBuffer)
 	{
-		page = BufferGetPage(parentBuffer);
+		SpGistInnerTuple	parentTuple;
 
-		*blkno = BufferGetBlockNumber(parentBuffer);
-		*offset = PageAddItem(page, (Item)innerTuple, innerTuple->size,
-								InvalidOffsetNumber, false, false);
-		Assert(*offset != InvalidOffsetNumber);
+		page = BufferGetPage(parentBuffer);
+		if (innerBuffer == parentBuffer)
+			innerOffset = PageAddItem(page, (Item)innerTuple, innerTuple->size,
+									  InvalidOffsetNumber, false, false);
+
+		parentTuple = (SpGistInnerTuple) PageGetItem(page, PageGetItemId(page, parentOffset));
+		updateNodeLink(state, parentTuple, parentNode,
+					   BufferGetBlockNumber(innerBuffer), innerOffset);
+		MarkBufferDirty(parentBuffer);
+		spgLogPage(index, state, parentBuffer);
+
+		/*
+		 * Unreachable from now on, but scans may have queued its chain,
+		 * so it keeps the tuples until deleteXid is older than every
+		 * running transaction
+		 */
+		SpGistPageSetDeleted(BufferGetPage(buffer));
+		SpGistPageGetOpaque(BufferGetPage(buffer))->deleteXid = deleteXid;
+		MarkBufferDirty(buffer);
+		spgLogPage(index, state, buffer);
 	}
-	else 
-	{
-		if (parentBuffer == InvalidBuffer) 
-		{
-			Assert( BufferGetBlockNumber(buffer) == SPGIST_HEAD_BLKNO);
-		}
-		else
-		{
-			/* XXX choose inner page with free space */
-			buffer = SpGistNewBuffer(index);
-		}
 
-		SpGistInitBuffer(buffer, 0);
-		page = BufferGetPage(buffer);
+	END_CRIT_SECTION();
 
-		*blkno = BufferGetBlockNumber(buffer);
-		*offset = PageAddItem(page, (Item)innerTuple, innerTuple->size,
-								InvalidOffsetNumber, false, false);
-		Assert(*offset != InvalidOffsetNumber);
+	spgAddPendingStats(index, &change);
 
-		MarkBufferDirty(buffer);
-		if (BufferGetBlockNumber(buffer) != SPGIST_HEAD_BLKNO)
-			UnlockReleaseBuffer(buffer);
-	} 
+	for(i=0; i<out.nNodes; i++)
+		if (leafBuffers[i] != InvalidBuffer)
+			UnlockReleaseBuffer(leafBuffers[i]);
+	if (innerBuffer != parentBuffer && innerBuffer != buffer)
+		UnlockReleaseBuffer(innerBuffer);
+
+	return true;
 }
 
 static SpGistInnerTuple 
-addNode(SpGistState *state, SpGistInnerTuple tuple, Datum datum)
+addNode(SpGistState *state, SpGistInnerTuple tuple, Datum datum, int nodeN)
 {
 	IndexTuple			node, *nodes;
 	bool				isnull = false;
 	int					i;
 
+	if (nodeN < 0 || nodeN > tuple->nNodes)
+		elog(ERROR, "invalid position %d of new node", nodeN);
 
 	nodes = palloc(sizeof(IndexTuple) * (tuple->nNodes + 1));
 	SGITITERATE(tuple, state, i, node)
-		nodes[i] = node;
+		nodes[(i < nodeN) ? i : i + 1] = node;
 
-	nodes[tuple->nNodes] = index_form_tuple(state->nodeTupDesc, &datum, &isnull);
+	nodes[nodeN] = index_form_tuple(state->nodeTupDesc, &datum, &isnull);
 
 	return spgFormInnerTuple(state,
 								!!tuple->hasPrefix, SGITDATUM(tuple, state),
 								tuple->nNodes + 1, nodes);
 }
 
+/*
+ * NULLs are not given to the opclass, they are kept in a list of pages
+ * starting at SPGIST_NULLS_BLKNO, which only keyless scans read. New tuples
+ * go to the first page. When it is full, its tuples are copied to a new
+ * page linked right after it and it starts empty again, so a scan reading
+ * the list page by page neither misses nor repeats a tuple.
+ */
+void
+spgInsertNull(Relation index, SpGistState *state, ItemPointer heapPtr)
+{
+	SpGistLeafTupleData	leafTuple;
+	Size				needed = MAXALIGN(SGLTHDRSZ) + MAXALIGN(sizeof(ItemIdData));
+	Buffer				buffer,
+						newBuffer = InvalidBuffer;
+	Page				page;
+	OffsetNumber		offset;
+
+	memset(&leafTuple, 0, sizeof(leafTuple));
+	leafTuple.heapPtr = *heapPtr;
+	leafTuple.nextOffset = InvalidOffsetNumber;
+
+	buffer = ReadBuffer(index, SPGIST_NULLS_BLKNO);
+	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+	page = BufferGetPage(buffer);
+
+	if (PageGetFreeSpace(page) < needed)
+		newBuffer = SpGistNewBuffer(index, !state->bulkBuild);
+
+	START_CRIT_SECTION();
+
+	if (newBuffer != InvalidBuffer)
+	{
+		/* the copy is written first, then the first page links to it */
+		memcpy(BufferGetPage(newBuffer), page, BufferGetPageSize(buffer));
+		MarkBufferDirty(newBuffer);
+		spgLogPage(index, state, newBuffer);
+
+		SpGistInitBuffer(buffer, SPGIST_NULLS);
+		SpGistPageGetOpaque(page)->nextBlkno = BufferGetBlockNumber(newBuffer);
+	}
+
+	offset = PageAddItem(page, (Item)&leafTuple, SGLTHDRSZ,
+						 InvalidOffsetNumber, false, false);
+	Assert(offset != InvalidOffsetNumber);
+
+	MarkBufferDirty(buffer);
+	spgLogPage(index, state, buffer);
+
+	END_CRIT_SECTION();
+
+	if (newBuffer != InvalidBuffer)
+		UnlockReleaseBuffer(newBuffer);
+	UnlockReleaseBuffer(buffer);
+}
+
 void
 spgdoinsert(Relation index, SpGistState *state, ItemPointer heapPtr, Datum datum)
 {
@@ -198,6 +379,16 @@ spgdoinsert(Relation index, SpGistState *state, ItemPointer heapPtr, Datum datum
 	BlockNumber	 	blkno = SPGIST_HEAD_BLKNO;
 	Datum			leafDatum = datum;
 	int				level = 0;
+	int				depth = 0;
+	SpGistStats		change;
+	instr_time		eventStart;
+	bool			fromCache;
+
+	memset(&change, 0, sizeof(change));
+
+	/* skip the cached upper levels, see spgcache.c */
+	fromCache = spgCacheDescend(index, state, datum, &blkno, &currentOffset,
+								&level, &depth);
 
 	for(;;) {
 		Page		page;
@@ -209,9 +400,10 @@ spgdoinsert(Relation index, SpGistState *state, ItemPointer heapPtr, Datum datum
 			/*
 			 * create a leaf page
 			 */
-			currentBuffer = SpGistNewBuffer(index);
+			currentBuffer = SpGistNewBuffer(index, !state->bulkBuild);
 			SpGistInitBuffer(currentBuffer, SPGIST_LEAF);
 			blkno = BufferGetBlockNumber(currentBuffer);
+			change.nLeafPages++;
 		}
 		else
 		{
@@ -223,74 +415,126 @@ spgdoinsert(Relation index, SpGistState *state, ItemPointer heapPtr, Datum datum
 		}
 		page = BufferGetPage(currentBuffer);
 
-		if (SpGistPageIsLeaf(page))
+		if (fromCache)
 		{
-			SpGistLeafTuple	leafTuple = spgFormLeafTuple(state, heapPtr, leafDatum);
-
-			if (PageGetFreeSpace(page) >= MAXALIGN(leafTuple->size) + MAXALIGN(sizeof(ItemIdData))) {
-				leafTuple->nextOffset = currentOffset;
-				currentOffset = PageAddItem(page, (Item)leafTuple, leafTuple->size,
-													InvalidOffsetNumber, false, false);
-				Assert(currentOffset != InvalidOffsetNumber);
+			fromCache = false;
 
-				MarkBufferDirty(currentBuffer);
+			if (!spgUpperCacheIsValid(index))
+			{
+				/* changed since the cache was built, go from the root */
 				UnlockReleaseBuffer(currentBuffer);
+				blkno = SPGIST_HEAD_BLKNO;
+				currentOffset = FirstOffsetNumber;
+				level = 0;
+				depth = 0;
+				continue;
+			}
+			Assert(!SpGistPageIsLeaf(page));
+		}
 
-				if (parentBuffer != InvalidOffsetNumber) {
-					SpGistInnerTuple innerTuple;
-
-					page = BufferGetPage(parentBuffer);
-					innerTuple = (SpGistInnerTuple) PageGetItem(page,
-																PageGetItemId(page, parentOffset));
+		if (SpGistPageIsLeaf(page))
+		{
+			SpGistLeafTuple	leafTuple = spgFormLeafTuple(state, heapPtr, leafDatum);
+			Size			needed = MAXALIGN(SGLTSIZE(leafTuple, state)) + MAXALIGN(sizeof(ItemIdData));
+			bool			mustSplit,
+							trySplit;
 
-					updateNodeLink(state, innerTuple, parentNode, blkno, currentOffset);
+			/*
+			 * A full page must be split. Pages filled up to fillfactor by
+			 * build and chains of maxChainLength tuples are split only if
+			 * picksplit separates the tuples.
+			 */
+			mustSplit = (PageGetFreeSpace(page) < needed);
+			trySplit = !mustSplit &&
+				(PageGetFreeSpace(page) < needed + state->leafFreeSpace ||
+				 (state->maxChainLength > 0 && parentBuffer != InvalidBuffer &&
+				  chainLength(page, currentOffset) >= state->maxChainLength));
+
+			if (mustSplit || trySplit) { /* picksplit */
+				SPGIST_EVENT_START(eventStart);
+				if (doPickSplit(index, state, currentBuffer, level,
+								parentBuffer, parentOffset, parentNode,
+								currentOffset, trySplit))
+				{
+					if (depth < SPGIST_CACHE_MAX_LEVELS)
+						spgBumpUpperVersion(index, state);
+					SPGIST_EVENT_END(index, SPGIST_EV_PICKSPLIT, eventStart);
 
-					MarkBufferDirty(parentBuffer);
-					UnlockReleaseBuffer(parentBuffer);
+					if (parentBuffer != InvalidBuffer)
+						UnlockReleaseBuffer(parentBuffer);
+					UnlockReleaseBuffer(currentBuffer);
+			
+					/* simplify for now */
+					SPGIST_EVENT_COUNT(index, SPGIST_EV_RESTART);
+					spgdoinsert(index, state, heapPtr, datum);
+					return;
 				}
+			}
 
-				break; /* go away */
-			} else { /* picksplit */
-				if (parentBuffer == InvalidBuffer)
-				{
-					OffsetNumber	j, max = SpGistPageGetMaxOffset(page);
-
-					Assert(blkno == SPGIST_HEAD_BLKNO);
+			change.nLeafTuples++;
+			if (currentOffset == InvalidOffsetNumber)
+				change.nChains++;
+			change.maxDepth = Max(change.maxDepth, depth);
 
-					for(j=FirstOffsetNumber; j<=max; j++) 
-					{
-						SpGistLeafTuple	lt;
+			if (parentBuffer != InvalidBuffer && currentOffset != InvalidOffsetNumber)
+			{
+				/*
+				 * Link the new tuple after the head of the chain, the link
+				 * of the parent stays valid and only the leaf page changes
+				 */
+				SpGistLeafTuple	head;
+				OffsetNumber	newOffset;
+
+				START_CRIT_SECTION();
+				head = (SpGistLeafTuple) PageGetItem(page, PageGetItemId(page, currentOffset));
+				leafTuple->nextOffset = head->nextOffset;
+				newOffset = PageAddItem(page, (Item)leafTuple, SGLTSIZE(leafTuple, state),
+										InvalidOffsetNumber, false, false);
+				Assert(newOffset != InvalidOffsetNumber);
+
+				head = (SpGistLeafTuple) PageGetItem(page, PageGetItemId(page, currentOffset));
+				head->nextOffset = newOffset;
 
-						lt = (SpGistLeafTuple) PageGetItem(page, PageGetItemId(page, j));
+				MarkBufferDirty(currentBuffer);
+				spgLogPage(index, state, currentBuffer);
+				END_CRIT_SECTION();
+				spgAddPendingStats(index, &change);
+				UnlockReleaseBuffer(currentBuffer);
+				UnlockReleaseBuffer(parentBuffer);
 
-						lt->nextOffset = (j==max) ? InvalidOffsetNumber : j+1;
-					}
+				break; /* go away */
+			}
 
-				}
-				
-				doPickSplit(index, state, currentBuffer, parentBuffer, &blkno, &currentOffset /* in/out */);
-				MarkBufferDirty(currentBuffer);
+			/* a new chain: the leaf page first, then the link to it */
+			START_CRIT_SECTION();
+			leafTuple->nextOffset = currentOffset;
+			currentOffset = PageAddItem(page, (Item)leafTuple, SGLTSIZE(leafTuple, state),
+												InvalidOffsetNumber, false, false);
+			Assert(currentOffset != InvalidOffsetNumber);
 
-				if (parentBuffer != InvalidOffsetNumber) {
-					SpGistInnerTuple innerTuple;
+			MarkBufferDirty(currentBuffer);
+			spgLogPage(index, state, currentBuffer);
 
-					page = BufferGetPage(parentBuffer);
-					innerTuple = (SpGistInnerTuple) PageGetItem(page,
-																PageGetItemId(page, parentOffset));
+			if (parentBuffer != InvalidOffsetNumber) {
+				SpGistInnerTuple innerTuple;
 
-					updateNodeLink(state, innerTuple, parentNode, blkno, currentOffset);
+				page = BufferGetPage(parentBuffer);
+				innerTuple = (SpGistInnerTuple) PageGetItem(page,
+															PageGetItemId(page, parentOffset));
 
-					MarkBufferDirty(parentBuffer);
-					UnlockReleaseBuffer(parentBuffer);
-				}
+				updateNodeLink(state, innerTuple, parentNode, blkno, currentOffset);
 
-				if (parentBuffer != currentBuffer)
-					UnlockReleaseBuffer(currentBuffer);
-		
-				/* simplify for now */
-				spgdoinsert(index, state, heapPtr, datum);
-				return;
+				MarkBufferDirty(parentBuffer);
+				spgLogPage(index, state, parentBuffer);
 			}
+			END_CRIT_SECTION();
+			spgAddPendingStats(index, &change);
+
+			UnlockReleaseBuffer(currentBuffer);
+			if (parentBuffer != InvalidBuffer)
+				UnlockReleaseBuffer(parentBuffer);
+
+			break; /* go away */
 		}
 		else /* non leaf */
 		{
@@ -303,6 +547,10 @@ spgdoinsert(Relation index, SpGistState *state, ItemPointer heapPtr, Datum datum
 research:
 			innerTuple = (SpGistInnerTuple) PageGetItem(page,
 														PageGetItemId(page, currentOffset));
+			/* the parent is locked, so its link can't lead to a moved tuple */
+			if (SGITISREDIRECT(innerTuple))
+				elog(ERROR, "unexpected redirect in SP-GiST index \"%s\" at block %u offset %u",
+					 RelationGetRelationName(index), blkno, currentOffset);
 			in.datum = datum;
 			in.level = level;
 			in.hasPrefix = !!innerTuple->hasPrefix;
@@ -331,6 +579,7 @@ research:
 					parentOffset = currentOffset;
 					parentNode = out.result.matchNode.nodeN;
 					level += out.result.matchNode.levelAdd;
+					depth++;
 					leafDatum = out.result.matchNode.restDatum;
 					SGITITERATE(innerTuple, state, i, node)
 					{
@@ -352,56 +601,96 @@ research:
 					break;
 				case spgAddNode:
 					{
-					SpGistInnerTuple newInnerTuple = addNode(state, innerTuple, out.result.addNode.nodeDatum);
+					SpGistInnerTuple newInnerTuple;
+
+					SPGIST_EVENT_START(eventStart);
+					newInnerTuple = addNode(state, innerTuple,
+											out.result.addNode.nodeDatum,
+											out.result.addNode.nodeN);
+
+					change.nNodes++;
 					if (PageGetFreeSpace(page) >= 
 							MAXALIGN(newInnerTuple->size) - MAXALIGN(innerTuple->size))
 					{
+						START_CRIT_SECTION();
 						PageIndexTupleDelete(page, currentOffset);
 						PageAddItem(page, (Item)newInnerTuple, newInnerTuple->size,
 									currentOffset, false, false);
 						
 						MarkBufferDirty(currentBuffer);
+						spgLogPage(index, state, currentBuffer);
+						END_CRIT_SECTION();
+						spgAddPendingStats(index, &change);
+						if (depth < SPGIST_CACHE_MAX_LEVELS)
+							spgBumpUpperVersion(index, state);
+						SPGIST_EVENT_END(index, SPGIST_EV_ADDNODE, eventStart);
 						/* actually, we will go to spgMatchNode case */
 						goto research;
 					} else {
-						/* move tuple to another page, and update parent */
-						Datum 	zero = 0;
-						
-						Assert(blkno != SPGIST_HEAD_BLKNO);
 						/*
-						 * ugly but temporary
-						 * replace old tuple with empty new. We could not delete
-						 * tuple to prevent wrong links from another parents
+						 * Move the tuple to another page and update the parent.
+						 * The copy is written first and the parent is switched
+						 * to it, only then the old tuple is replaced by a
+						 * redirect to the copy: we could not delete it, scans
+						 * may have queued its location. The new page is taken
+						 * before any change.
 						 */
-						PageIndexTupleDelete(page, currentOffset);
-						PageAddItem(page, (Item)&zero, sizeof(zero), currentOffset, false, false);
-						MarkBufferDirty(currentBuffer);
-						if (parentBuffer != currentBuffer)
-							UnlockReleaseBuffer(currentBuffer);
+						Buffer			newBuffer;
+						SpGistInnerTuple	redirect;
+						BlockNumber		newBlkno;
+						OffsetNumber	newOffset;
+						
+						Assert(blkno != SPGIST_HEAD_BLKNO);
+						Assert(parentBuffer != InvalidBuffer);
 
-						currentBuffer = SpGistNewBuffer(index);
-						SpGistInitBuffer(currentBuffer, 0);
+						newBuffer = SpGistNewBuffer(index, !state->bulkBuild);
+						newBlkno = BufferGetBlockNumber(newBuffer);
+						redirect = palloc0(SGITREDIRECTSZ);
+						/* the placeholder left behind counts as inner tuple */
+						change.nInnerPages++;
+						change.nInnerTuples++;
 
-						page = BufferGetPage(currentBuffer);
-	
-						blkno = BufferGetBlockNumber(currentBuffer);
-						currentOffset = PageAddItem(page, (Item)newInnerTuple, newInnerTuple->size,
-													InvalidOffsetNumber, false, false);
+						START_CRIT_SECTION();
 
+						SpGistInitBuffer(newBuffer, 0);
+						newOffset = PageAddItem(BufferGetPage(newBuffer), (Item)newInnerTuple,
+												newInnerTuple->size, InvalidOffsetNumber, false, false);
+						MarkBufferDirty(newBuffer);
+						spgLogPage(index, state, newBuffer);
+
+						/* the parent may be on the page of the old tuple */
+						page = BufferGetPage(parentBuffer);
+						innerTuple = (SpGistInnerTuple) PageGetItem(page,
+																	PageGetItemId(page, parentOffset));
+						updateNodeLink(state, innerTuple, parentNode, newBlkno, newOffset);
+						ItemPointerSet(SGITREDIRECT(redirect), newBlkno, newOffset);
+						if (parentBuffer != currentBuffer)
+						{
+							MarkBufferDirty(parentBuffer);
+							spgLogPage(index, state, parentBuffer);
+						}
+
+						page = BufferGetPage(currentBuffer);
+						PageIndexTupleDelete(page, currentOffset);
+						PageAddItem(page, (Item)redirect, SGITREDIRECTSZ, currentOffset, false, false);
 						MarkBufferDirty(currentBuffer);
-						UnlockReleaseBuffer(currentBuffer);
+						spgLogPage(index, state, currentBuffer);
 
-						if (parentBuffer != InvalidOffsetNumber) {
-							page = BufferGetPage(parentBuffer);
-							innerTuple = (SpGistInnerTuple) PageGetItem(page,
-																		PageGetItemId(page, parentOffset));
+						END_CRIT_SECTION();
 
-							updateNodeLink(state, innerTuple, parentNode, blkno, currentOffset);
+						spgAddPendingStats(index, &change);
 
-							MarkBufferDirty(parentBuffer);
-							UnlockReleaseBuffer(parentBuffer);
-						}
+						/* the link changed is in the parent, one level up */
+						if (depth <= SPGIST_CACHE_MAX_LEVELS)
+							spgBumpUpperVersion(index, state);
 
+						UnlockReleaseBuffer(newBuffer);
+						if (parentBuffer != currentBuffer)
+							UnlockReleaseBuffer(currentBuffer);
+						UnlockReleaseBuffer(parentBuffer);
+
+						SPGIST_EVENT_END(index, SPGIST_EV_ADDNODE_MOVE, eventStart);
+						SPGIST_EVENT_COUNT(index, SPGIST_EV_RESTART);
 						spgdoinsert(index, state, heapPtr, datum);
 						return;
 					}
@@ -412,7 +701,11 @@ research:
 					SpGistInnerTuple	prefixTuple, postfixTuple;
 					IndexTuple			*nodes;
 					bool				isnull = false;
+					Buffer				newBuffer = InvalidBuffer;
+					BlockNumber			postfixBlkno;
+					OffsetNumber		postfixOffset;
 			
+					SPGIST_EVENT_START(eventStart);
 
 					node = index_form_tuple(state->nodeTupDesc, 
 											&out.result.splitTuple.nodeDatum, &isnull);
@@ -429,45 +722,70 @@ research:
 													out.result.splitTuple.postfixHasPrefix,
 													out.result.splitTuple.postfixPrefixDatum,
 													innerTuple->nNodes, nodes);
-					
+
+					change.nSplits++;
+					change.nInnerTuples++;
+					change.nNodes++;
+
+					/*
+					 * The postfix tuple goes to the same page if it fits after
+					 * the prefix tuple replaced the old one, otherwise to a new
+					 * page, taken before any change. It is written before the
+					 * prefix tuple linking to it.
+					 */
+					if (blkno == SPGIST_HEAD_BLKNO ||
+						PageGetFreeSpace(page) + MAXALIGN(innerTuple->size) <
+							MAXALIGN(prefixTuple->size) + MAXALIGN(postfixTuple->size) +
+							MAXALIGN(sizeof(ItemIdData)) + state->innerFreeSpace)
+					{
+						newBuffer = SpGistNewBuffer(index, !state->bulkBuild);
+						change.nInnerPages++;
+					}
+
+					START_CRIT_SECTION();
+
+					if (newBuffer != InvalidBuffer)
+					{
+						SpGistInitBuffer(newBuffer, 0);
+						postfixBlkno = BufferGetBlockNumber(newBuffer);
+						postfixOffset = PageAddItem(BufferGetPage(newBuffer), (Item)postfixTuple,
+													postfixTuple->size, InvalidOffsetNumber, false, false);
+						MarkBufferDirty(newBuffer);
+						spgLogPage(index, state, newBuffer);
+					}
+
 					PageIndexTupleDelete(page, currentOffset);
 					currentOffset = PageAddItem(page, (Item)prefixTuple, 
 									prefixTuple->size, currentOffset, false, false);
 					Assert( currentOffset != InvalidOffsetNumber);
 
-					innerTuple = (SpGistInnerTuple) PageGetItem(page,
-														PageGetItemId(page, currentOffset));
-
-					if (PageGetFreeSpace(page) >= MAXALIGN(postfixTuple->size) +
-												  MAXALIGN(sizeof(ItemIdData)) && 
-						blkno != SPGIST_HEAD_BLKNO) 
+					if (newBuffer == InvalidBuffer)
 					{
-						currentOffset = PageAddItem(page, (Item)postfixTuple, 
+						postfixBlkno = blkno;
+						postfixOffset = PageAddItem(page, (Item)postfixTuple, 
 										postfixTuple->size, InvalidOffsetNumber, false, false);
-						Assert( currentOffset != InvalidOffsetNumber);
+						Assert( postfixOffset != InvalidOffsetNumber);
 					}
-					else
-					{
-						Buffer newBuffer = SpGistNewBuffer(index);
 
-						Assert(!(blkno = SPGIST_HEAD_BLKNO && currentOffset == FirstOffsetNumber));
+					innerTuple = (SpGistInnerTuple) PageGetItem(page,
+														PageGetItemId(page, currentOffset));
+					updateNodeLink(state, innerTuple, 0, postfixBlkno, postfixOffset);
+					MarkBufferDirty(currentBuffer);
+					spgLogPage(index, state, currentBuffer);
 
-						SpGistInitBuffer(newBuffer, 0);
+					END_CRIT_SECTION();
 
-						page = BufferGetPage(newBuffer);
-	
-						blkno = BufferGetBlockNumber(newBuffer);
-						currentOffset = PageAddItem(page, (Item)postfixTuple, postfixTuple->size,
-													InvalidOffsetNumber, false, false);
-						MarkBufferDirty(newBuffer);
-						UnlockReleaseBuffer(newBuffer);
-					}
+					spgAddPendingStats(index, &change);
 
-					updateNodeLink(state, innerTuple, 0, blkno, currentOffset);
-					MarkBufferDirty(currentBuffer);
+					if (newBuffer != InvalidBuffer)
+						UnlockReleaseBuffer(newBuffer);
+					if (depth < SPGIST_CACHE_MAX_LEVELS)
+						spgBumpUpperVersion(index, state);
 					UnlockReleaseBuffer(currentBuffer);
-					if (currentBuffer != parentBuffer) 
+					if (parentBuffer != InvalidBuffer && currentBuffer != parentBuffer) 
 						UnlockReleaseBuffer(parentBuffer);
+					SPGIST_EVENT_END(index, SPGIST_EV_SPLITTUPLE, eventStart);
+					SPGIST_EVENT_COUNT(index, SPGIST_EV_RESTART);
 					spgdoinsert(index, state, heapPtr, datum);
 					return;
 					}
@@ -39,6 +39,8 @@ spgistBuildCallback(Relation index, HeapTuple htup, Datum *values,
 		MemoryContextSwitchTo(oldCtx);
 		MemoryContextReset(buildstate->tmpCtx);
 	}
+	else
+		spgInsertNull(index, &buildstate->spgstate, &htup->t_self);
 }
 
 PG_FUNCTION_INFO_V1(spgbuild);
@@ -52,26 +54,39 @@ spgbuild(PG_FUNCTION_ARGS)
 	IndexBuildResult *result;
 	double      reltuples;
 	SpGistBuildState buildstate;
-	Buffer      MetaBuffer, buffer;
+	SpGistStats	stats;
+	Buffer      MetaBuffer, buffer, nullsBuffer;
+	bool		bulkBuild = SpGistGetOption(index, bulkBuild, true);
 
 	if (RelationGetNumberOfBlocks(index) != 0)
 		elog(ERROR, "index \"%s\" already contains data",
 					RelationGetRelationName(index));
 
-	/* initialize the meta page */
-	MetaBuffer = SpGistNewBuffer(index);
-	buffer = SpGistNewBuffer(index);
+	/* initialize the meta page, the root and the first page of NULLs */
+	MetaBuffer = SpGistNewBuffer(index, !bulkBuild);
+	buffer = SpGistNewBuffer(index, !bulkBuild);
+	nullsBuffer = SpGistNewBuffer(index, !bulkBuild);
+	Assert(BufferGetBlockNumber(nullsBuffer) == SPGIST_NULLS_BLKNO);
 
 	START_CRIT_SECTION();
 	SpGistInitMetabuffer(MetaBuffer, index);
 	MarkBufferDirty(MetaBuffer);
 	SpGistInitBuffer(buffer, SPGIST_LEAF);
 	MarkBufferDirty(buffer);
+	SpGistInitBuffer(nullsBuffer, SPGIST_NULLS);
+	MarkBufferDirty(nullsBuffer);
 	END_CRIT_SECTION();
 	UnlockReleaseBuffer(MetaBuffer);
 	UnlockReleaseBuffer(buffer);
+	UnlockReleaseBuffer(nullsBuffer);
 
 	initSpGistState(&buildstate.spgstate, index);
+	buildstate.spgstate.leafFreeSpace = SpGistGetTargetPageFreeSpace(
+		SpGistGetOption(index, leafFillfactor, SPGIST_DEFAULT_FILLFACTOR));
+	buildstate.spgstate.innerFreeSpace = SpGistGetTargetPageFreeSpace(
+		SpGistGetOption(index, innerFillfactor, SPGIST_DEFAULT_FILLFACTOR));
+	buildstate.spgstate.bulkBuild = bulkBuild;
+	buildstate.spgstate.needWAL = false;
 
 	buildstate.tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
 											"SpGist build temporary context",
@@ -84,6 +99,12 @@ spgbuild(PG_FUNCTION_ARGS)
 									spgistBuildCallback, (void *) &buildstate);
 	MemoryContextDelete(buildstate.tmpCtx);
 
+	spgComputeStats(index, &buildstate.spgstate, NULL, &stats);
+	spgUpdateStats(index, &stats);
+
+	/* pages were not logged by the inserts */
+	spgLogIndex(index);
+
 	result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
 	result->heap_tuples = result->index_tuples = reltuples;
 
@@ -106,8 +127,9 @@ spginsert(PG_FUNCTION_ARGS)
 	SpGistState       spgstate;
 	MemoryContext   oldCtx;
 	MemoryContext   insertCtx;
-	SpGistMetaPageData   *metaData;
-	Buffer              metaBuffer;
+	instr_time			eventStart;
+
+	SPGIST_EVENT_START(eventStart);
 
 	insertCtx = AllocSetContextCreate(CurrentMemoryContext,
 										"SpGist insert temporary context",
@@ -117,16 +139,23 @@ spginsert(PG_FUNCTION_ARGS)
 	oldCtx = MemoryContextSwitchTo(insertCtx);
 
 	initSpGistState(&spgstate, index);
-	metaBuffer = ReadBuffer(index, SPGIST_METAPAGE_BLKNO);
-	LockBuffer(metaBuffer, BUFFER_LOCK_SHARE);
-	metaData = SpGistPageGetMeta(BufferGetPage(metaBuffer));
 
-	if (*isnull == false);
+	/*
+	 * The metapage is not held locked during the insert, spgdoinsert locks
+	 * it exclusively after data pages to bump upperVersion
+	 */
+	if (*isnull == false)
+	{
 		spgdoinsert(index, &spgstate, ht_ctid, *values);
-
-	UnlockReleaseBuffer(metaBuffer);
+		spgFlushPendingStats(index);
+	}
+	else
+		spgInsertNull(index, &spgstate, ht_ctid);
 	MemoryContextSwitchTo(oldCtx);
 	MemoryContextDelete(insertCtx);
+
+	SPGIST_EVENT_END(index, SPGIST_EV_INSERT, eventStart);
+
 	PG_RETURN_BOOL(false);
 }
 
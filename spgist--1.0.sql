@@ -45,6 +45,11 @@ RETURNS internal
 AS 'MODULE_PATHNAME'
 LANGUAGE C;
 
+CREATE OR REPLACE FUNCTION spggettuple(internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
 CREATE OR REPLACE FUNCTION spgbulkdelete(internal)
 RETURNS internal
 AS 'MODULE_PATHNAME'
@@ -99,19 +104,19 @@ INSERT INTO pg_am (
 	0,                  --amstrategies
 	5,                  --amsupport
 	'f',                --amcanorder
-	'f',                --amcanorderbyop
+	't',                --amcanorderbyop
 	'f',                --amcanbackward
 	'f',                --amcanunique
 	'f',                --amcanmulticol
-	'f',                --amoptionalkey
+	't',                --amoptionalkey
 	'f',                --amsearchnulls
 	'f',                --amstorage
-	'f',                --amclusterable
+	't',                --amclusterable
 	'f',                --ampredlocks
 	2281,               --amkeytype
 	'spginsert',        --aminsert
 	'spgbeginscan',     --ambeginscan
-	'-',                --amgettuple
+	'spggettuple',      --amgettuple
 	'spggetbitmap',     --amgetbitmap
 	'spgrescan',        --amrescan
 	'spgendscan',       --amendscan
@@ -142,7 +147,7 @@ RETURNS internal
 AS 'MODULE_PATHNAME'
 LANGUAGE C;
 
-CREATE OR REPLACE FUNCTION spg_text_leaf_consistent(internal, internal, internal)
+CREATE OR REPLACE FUNCTION spg_text_leaf_consistent(internal, internal)
 RETURNS internal
 AS 'MODULE_PATHNAME'
 LANGUAGE C;
@@ -152,14 +157,32 @@ RETURNS internal
 AS 'MODULE_PATHNAME'
 LANGUAGE C;
 
+CREATE OR REPLACE FUNCTION spg_text_starts_with(text, text)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OPERATOR ^@ (
+	LEFTARG = text,
+	RIGHTARG = text,
+	PROCEDURE = spg_text_starts_with,
+	RESTRICT = contsel,
+	JOIN = contjoinsel
+);
+
 CREATE OPERATOR CLASS text_ops DEFAULT
 FOR TYPE text USING spgist
 AS
-        OPERATOR        1       = (text, text),
+        OPERATOR        1       ~<~ (text, text),
+        OPERATOR        2       ~<=~ (text, text),
+        OPERATOR        3       = (text, text),
+        OPERATOR        4       ~>=~ (text, text),
+        OPERATOR        5       ~>~ (text, text),
+        OPERATOR        6       ^@ (text, text),
 		FUNCTION        1       spg_text_config(internal),
 		FUNCTION        2       spg_text_choose(internal, internal),
 		FUNCTION        3       spg_text_picksplit(internal, internal),
-		FUNCTION        4       spg_text_leaf_consistent(internal, internal, internal),
+		FUNCTION        4       spg_text_leaf_consistent(internal, internal),
 		FUNCTION		5		spg_text_inner_consistent(internal, internal)
 ;
 
@@ -180,7 +203,7 @@ RETURNS internal
 AS 'MODULE_PATHNAME'
 LANGUAGE C;
 
-CREATE OR REPLACE FUNCTION spg_quad_leaf_consistent(internal, internal, internal)
+CREATE OR REPLACE FUNCTION spg_quad_leaf_consistent(internal, internal)
 RETURNS internal
 AS 'MODULE_PATHNAME'
 LANGUAGE C;
@@ -193,14 +216,77 @@ LANGUAGE C;
 CREATE OPERATOR CLASS point_quadtree_ops DEFAULT
 FOR TYPE point USING spgist
 AS
-        OPERATOR        1       ~= (point, point),
+        OPERATOR        1       << (point, point),
+        OPERATOR        5       >> (point, point),
+        OPERATOR        6       ~= (point, point),
+        OPERATOR        8       <@ (point, box),
+        OPERATOR        10      <^ (point, point),
+        OPERATOR        11      >^ (point, point),
+        OPERATOR        15      <-> (point, point) FOR ORDER BY float_ops,
 		FUNCTION        1       spg_quad_config(internal),
 		FUNCTION        2       spg_quad_choose(internal, internal),
 		FUNCTION        3       spg_quad_picksplit(internal, internal),
-		FUNCTION        4       spg_quad_leaf_consistent(internal, internal, internal),
+		FUNCTION        4       spg_quad_leaf_consistent(internal, internal),
 		FUNCTION		5		spg_quad_inner_consistent(internal, internal)
 ;
 
+--Quadtree opclass with median centroids, for skewed data
+
+CREATE OR REPLACE FUNCTION spg_quad_picksplit_median(internal, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE OPERATOR CLASS point_quadtree_median_ops
+FOR TYPE point USING spgist
+AS
+        OPERATOR        1       << (point, point),
+        OPERATOR        5       >> (point, point),
+        OPERATOR        6       ~= (point, point),
+        OPERATOR        8       <@ (point, box),
+        OPERATOR        10      <^ (point, point),
+        OPERATOR        11      >^ (point, point),
+        OPERATOR        15      <-> (point, point) FOR ORDER BY float_ops,
+		FUNCTION        1       spg_quad_config(internal),
+		FUNCTION        2       spg_quad_choose(internal, internal),
+		FUNCTION        3       spg_quad_picksplit_median(internal, internal),
+		FUNCTION        4       spg_quad_leaf_consistent(internal, internal),
+		FUNCTION		5		spg_quad_inner_consistent(internal, internal)
+;
+
+--k-d tree opclass
+
+CREATE OR REPLACE FUNCTION spg_kd_config(internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION spg_kd_choose(internal, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION spg_kd_picksplit(internal, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION spg_kd_inner_consistent(internal, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE OPERATOR CLASS point_kd_ops
+FOR TYPE point USING spgist
+AS
+        OPERATOR        6       ~= (point, point),
+		FUNCTION        1       spg_kd_config(internal),
+		FUNCTION        2       spg_kd_choose(internal, internal),
+		FUNCTION        3       spg_kd_picksplit(internal, internal),
+		FUNCTION        4       spg_quad_leaf_consistent(internal, internal),
+		FUNCTION		5		spg_kd_inner_consistent(internal, internal)
+;
+
 --debug
 
 CREATE OR REPLACE FUNCTION spgstat(text)
@@ -208,3 +294,78 @@ RETURNS text
 AS 'MODULE_PATHNAME'
 LANGUAGE C;
 
+
+CREATE OR REPLACE FUNCTION spgmetastat(text)
+RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION spg_analyze(
+	index text,
+	sample_pct float8 DEFAULT 100,
+	OUT level int4,
+	OUT inner_tuples int8,
+	OUT avg_fanout float8,
+	OUT fanout_hist int8[],
+	OUT avg_prefix_size float8,
+	OUT leaf_chains int8,
+	OUT leaf_tuples int8,
+	OUT max_chain_length int4,
+	OUT chain_length_hist int8[],
+	OUT inner_pages int4,
+	OUT inner_fill float8,
+	OUT leaf_pages int4,
+	OUT leaf_fill float8,
+	OUT placeholders int8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION spg_scan_stats(
+	OUT indexrelid regclass,
+	OUT scans int8,
+	OUT inner_tuples int8,
+	OUT nodes_selected int8,
+	OUT leaf_tested int8,
+	OUT leaf_matched int8,
+	OUT pages int8,
+	OUT max_depth int4)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION spg_scan_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+-- scans of the current session only, totals are kept per backend
+CREATE VIEW spg_stat_scans AS SELECT * FROM spg_scan_stats();
+
+CREATE OR REPLACE FUNCTION spg_insert_stats(
+	OUT indexrelid regclass,
+	OUT event text,
+	OUT count int8,
+	OUT total_time float8,
+	OUT time_hist int8[])
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION spg_insert_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION spg_bench_opclass(
+	opclass text,
+	dataset text,
+	iterations int4,
+	OUT function text,
+	OUT calls int8,
+	OUT ns_per_op float8,
+	OUT allocs_per_op float8,
+	OUT peak_bytes int8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
@@ -3,8 +3,12 @@
 
 #include "access/genam.h"
 #include "access/itup.h"
+#include "access/tupmacs.h"
 #include "access/xlog.h"
 #include "fmgr.h"
+#include "nodes/tidbitmap.h"
+#include "portability/instr_time.h"
+#include "utils/hsearch.h"
 
 
 #define SPGIST_PROP_PROC		1
@@ -25,6 +29,8 @@ typedef struct SpGistPageOpaqueData
 {
 	uint16         nParents;
 	uint16         flags;
+	TransactionId  deleteXid;	/* next xid when SPGIST_DELETED was set */
+	BlockNumber    nextBlkno;	/* next page of the NULLs list */
 } SpGistPageOpaqueData;
 
 typedef SpGistPageOpaqueData *SpGistPageOpaque;
@@ -33,6 +39,7 @@ typedef SpGistPageOpaqueData *SpGistPageOpaque;
 #define SPGIST_DELETED  	(1<<1)
 #define SPGIST_LEAF   		(1<<2)
 #define SPGIST_HAS_DELETED  (1<<3)
+#define SPGIST_NULLS		(1<<4)
 
 #define SpGistPageGetOpaque(page) ( (SpGistPageOpaque) PageGetSpecialPointer(page) )
 #define SpGistPageGetMaxOffset(page) PageGetMaxOffsetNumber(page)
@@ -41,12 +48,35 @@ typedef SpGistPageOpaqueData *SpGistPageOpaque;
 #define SpGistPageSetDeleted(page)    ( SpGistPageGetOpaque(page)->flags |= SPGIST_DELETED)
 #define SpGistPageSetNonDeleted(page) ( SpGistPageGetOpaque(page)->flags &= ~SPGIST_DELETED)
 #define SpGistPageIsLeaf(page) ( SpGistPageGetOpaque(page)->flags & SPGIST_LEAF)
+#define SpGistPageIsNulls(page) ( SpGistPageGetOpaque(page)->flags & SPGIST_NULLS)
 #define SpGistPageSetLeaf(page)    ( SpGistPageGetOpaque(page)->flags |= SPGIST_LEAF)
 #define SpGistPageSetInner(page) ( SpGistPageGetOpaque(page)->flags &= ~SPGIST_LEAF)
 #define SpGistPageGetData(page)      (  (SpGistLeafTuple*)PageGetContents(page) )
 
 #define SPGIST_METAPAGE_BLKNO    (0)
 #define SPGIST_HEAD_BLKNO        (1)
+#define SPGIST_NULLS_BLKNO       (2)	/* first page of the NULLs list */
+
+/*
+ * Shape of the tree, kept in the metapage for the planner and monitoring.
+ * Computed exactly by a full pass in build and vacuum. In between inserts
+ * accumulate changes in backend-local deltas which are added to the
+ * metapage every SPGIST_STATS_FLUSH inserts, so the values drift a little
+ * (deltas of exited backends are lost) until the next vacuum.
+ */
+typedef struct SpGistStats
+{
+	BlockNumber	nInnerPages;
+	BlockNumber	nLeafPages;
+	int64		nInnerTuples;
+	int64		nNodes;			/* links of all inner tuples */
+	int64		nLeafTuples;
+	int64		nChains;		/* leaf chains (or lone leaf tuples) */
+	int64		nSplits;		/* picksplits and tuple splits since build */
+	uint32		maxDepth;		/* inner tuples on the longest path */
+} SpGistStats;
+
+#define SPGIST_STATS_FLUSH	64
 
 typedef BlockNumber FreeBlockNumberArray[
 			MAXALIGN_DOWN(
@@ -54,7 +84,8 @@ typedef BlockNumber FreeBlockNumberArray[
 					SizeOfPageHeaderData -
 					MAXALIGN(sizeof(SpGistPageOpaqueData)) -
 					/* header of SpGistMetaPageData struct */
-					MAXALIGN(sizeof(uint16) * 2 + sizeof(uint32))
+					MAXALIGN(sizeof(uint16) * 2 + sizeof(uint32) * 2) -
+					MAXALIGN(sizeof(SpGistStats))
 			) / sizeof(BlockNumber)
 	];
 
@@ -63,10 +94,18 @@ typedef struct SpGistMetaPageData
 	uint32                  magickNumber;
 	uint16                  nStart;
 	uint16                  nEnd;
+	uint32                  upperVersion;	/* bumped on changes of upper
+											 * levels, see spgcache.c */
+	SpGistStats             stats;
 	FreeBlockNumberArray    notFullPage;
 } SpGistMetaPageData;
 
-#define SPGIST_MAGICK_NUMBER (0xBA0BABED)
+/*
+ * Changed with the on-disk format (was 0xBA0BABED before compact leaf
+ * tuples, redirects, deleteXid and the NULLs list), indexes with another
+ * one need REINDEX
+ */
+#define SPGIST_MAGICK_NUMBER (0xBA0BABEF)
 
 #define SpGistMetaBlockN     (sizeof(FreeBlockNumberArray) / sizeof(BlockNumber))
 #define SpGistPageGetMeta(p) \
@@ -77,8 +116,33 @@ typedef struct SpGistTypeDesc
 	Oid		type;
 	bool	attbyval;
 	int16	attlen;
+	char	attstorage;	/* leaf varlenas get short headers unless 'p' */
 } SpGistTypeDesc;
 
+/*
+ * Reloptions. fillfactor (of leaf pages) and inner_fillfactor are respected
+ * by build only, like in B-tree and GiST: later inserts may fill the room
+ * left free. Leaf chains reaching max_chain_length tuples are split even if
+ * their page has space. bulk_build makes build take new pages by extending
+ * the relation without asking the FSM, which is empty for a new index.
+ */
+typedef struct SpGistOptions
+{
+	int32	vl_len_;		/* varlena header (do not touch directly!) */
+	int		leafFillfactor;
+	int		innerFillfactor;
+	int		maxChainLength;	/* 0 means limited by page size only */
+	bool	bulkBuild;
+} SpGistOptions;
+
+#define SPGIST_MIN_FILLFACTOR		10
+#define SPGIST_DEFAULT_FILLFACTOR	100
+
+#define SpGistGetOption(index, field, default) \
+	( (index)->rd_options ? ((SpGistOptions *) (index)->rd_options)->field : (default) )
+#define SpGistGetTargetPageFreeSpace(fillfactor) \
+	( BLCKSZ * (100 - (fillfactor)) / 100 )
+
 typedef struct SpGistState
 {
 	SpGistOpClassProp	prop;
@@ -92,12 +156,93 @@ typedef struct SpGistState
 	FmgrInfo			innerConsistentFn;
 
 	TupleDesc			nodeTupDesc;
+
+	/* split policy, free space to leave is set by build only */
+	int					leafFreeSpace;
+	int					innerFreeSpace;
+	int					maxChainLength;
+	bool				bulkBuild;
+
+	bool				needWAL;	/* false during build, see spgxlog.c */
 } SpGistState;
 
+/*
+ * Decoded inner tuple of the upper levels cache, see spgcache.c
+ */
+typedef struct SpGistCachedInner
+{
+	BlockNumber		blkno;
+	OffsetNumber	offset;
+	bool			hasPrefix;
+	Datum			prefixDatum;
+	int				nNodes;
+	Datum			*nodeDatums;
+	ItemPointerData	*childPtrs;		/* invalid for nodes without tuples */
+	struct SpGistCachedInner **children;	/* cached child or NULL */
+	bool			allInner;		/* all children are inner tuples, so
+									 * childPtrs are covered by version */
+} SpGistCachedInner;
+
+#define SPGIST_CACHE_MAX_LEVELS	4
+#define SPGIST_CACHE_MAX_TUPLES	1024
+
+/*
+ * Pending work of a scan: either a page location to descend into or a
+ * heap pointer found by leaf test and not yet returned by gettuple.
+ */
+typedef struct SpGistSearchItem
+{
+	double			distance;	/* lower bound of distance to ORDER BY
+								 * argument, exact for heap tuples */
+	bool			isHeapTuple;
+	bool			isNulls;	/* blkno is a page of the NULLs list */
+	bool			recheck;	/* for heap tuple */
+	ItemPointerData	heapPtr;	/* for heap tuple */
+	BlockNumber		blkno;		/* location of inner tuple or leaf chain */
+	OffsetNumber	offset;
+	int				level;
+	int				depth;		/* inner tuples above */
+	void			*traversalValue;	/* opclass-specific, from parent's
+										 * inner_consistent */
+	SpGistCachedInner	*cached;	/* inner tuple at blkno/offset if cached */
+} SpGistSearchItem;
+
+/*
+ * Traversal counters of a scan, see spgstats.c
+ */
+typedef struct SpGistScanCounters
+{
+	int64			scans;
+	int64			innerTuples;	/* inner tuples visited */
+	int64			nodesSelected;	/* nodes returned by inner_consistent */
+	int64			leafTested;
+	int64			leafMatched;
+	int64			pages;			/* buffers read */
+	int				maxDepth;
+} SpGistScanCounters;
+
 typedef struct SpGistScanOpaqueData
 {
 	SpGistState  	state;
 	MemoryContext 	tempCxt;
+	MemoryContext	queueCxt;	/* items and traversal values, reset on rescan */
+
+	/*
+	 * Items to visit. Plain scans use them as a stack (depth-first
+	 * traversal), ordered scans as a binary heap by distance.
+	 */
+	bool				ordered;
+	bool				started;
+	bool				keyIsNull;	/* no tuple matches a NULL key */
+	SpGistSearchItem	**items;
+	int					nItems;
+	int					maxItems;
+
+	/* bitmap scan output */
+	TIDBitmap			*tbm;
+	int64				ntids;
+
+	SpGistScanCounters	counters;	/* since beginscan or last report */
 } SpGistScanOpaqueData;
 
 typedef SpGistScanOpaqueData *SpGistScanOpaque;
@@ -140,27 +285,41 @@ typedef SpGistInnerTupleData *SpGistInnerTuple;
 		(i) < (x)->nNodes; \
 		(i)++, (it) = (IndexTuple)(((char*)(it)) + IndexTupleSize(it))) 
 
+/*
+ * addNode moving an inner tuple to another page leaves a redirect at the
+ * old place: a header with size 0 followed by the new location. Scans
+ * which queued the old location before the move follow it.
+ */
+#define SGITISREDIRECT(x)	( (x)->size == 0 )
+#define SGITREDIRECT(x)		( (ItemPointer) _SGITDATA(x) )
+#define SGITREDIRECTSZ		( SGITHDRSZ + sizeof(ItemPointerData) )
+
 
 /*
  * indexed value could be empty (not a NULL) if it's
  * fully encoded in a tree path
+ *
+ * Leaf tuple layout: 8-byte header, then the datum without padding. Byval
+ * types take attlen bytes, varlenas up to 127 bytes get a 1-byte header.
+ * Items start MAXALIGN'd, so the datum at offset 8 is aligned for any
+ * typalign. There is no length field, on a page the line pointer has it,
+ * SGLTSIZE computes it from the datum.
  */
 typedef struct SpGistLeafTupleData
 {
 	ItemPointerData	heapPtr;
 	OffsetNumber	nextOffset;
-	unsigned short 	size;
 	char			data[1]; /* variable size */
 } SpGistLeafTupleData;
 typedef SpGistLeafTupleData *SpGistLeafTuple;
 
-#define SGLTHDRSZ			MAXALIGN(offsetof(SpGistLeafTupleData, data))
+#define SGLTHDRSZ			offsetof(SpGistLeafTupleData, data)
 #define SGLTDATAPTR(x)  	( ((char*)(x)) + SGLTHDRSZ )
-#define SGLTDATUM(x, s)		( ((s)->attType.attbyval) ? \
-								( *(Datum*)SGLTDATAPTR(x) ) \
-								: \
-								PointerGetDatum(SGLTDATAPTR(x)) \
-							)
+#define SGLTDATUM(x, s)		fetch_att(SGLTDATAPTR(x), (s)->attType.attbyval, \
+									  (s)->attType.attlen)
+#define SGLTSIZE(x, s)		( SGLTHDRSZ + \
+							  att_addlength_pointer(0, (s)->attType.attlen, \
+													SGLTDATAPTR(x)) )
 
 /*
  * interface struct
@@ -199,6 +358,7 @@ typedef struct spgChooseOut
 		} matchNode;
 		struct {
 			Datum	nodeDatum;
+			int		nodeN;	/* position of new node, later nodes shift right */
 		} addNode;
 		struct {
 			/* new inner tuple with one node */
@@ -219,6 +379,7 @@ typedef struct spgPickSplitIn
 {
 	int		nTuples;
 	Datum	*datums;
+	int		level;	/* level of the new inner tuple */
 } spgPickSplitIn;
 
 typedef struct spgPickSplitOut
@@ -235,9 +396,14 @@ typedef struct spgPickSplitOut
 
 typedef struct spgInnerConsistentIn
 {
-	Datum	query;
+	ScanKey	scankeys;	/* operators and arguments, all must be satisfied */
+	int		nkeys;
+	ScanKey	orderbys;	/* ORDER BY operators and arguments */
+	int		norderbys;
 
 	int		level;
+	void	*traversalValue;	/* value stored for this tuple by parent's call */
+	MemoryContext	traversalMemoryContext;	/* allocate traversalValues here */
 
 	bool	hasPrefix;
 	Datum	prefixDatum;
@@ -251,14 +417,47 @@ typedef struct spgInnerConsistentOut
 	int		nNodes;
 	int		levelAdd; /* including node's levels */
 	int		*nodeNumbers;
+
+	/* optional, one per returned node, NULL if not used */
+	void	**traversalValues;	/* separate pallocs, passed to child's
+								 * inner_consistent or leaf_consistent */
+	double	*distances;			/* lower bound of distance to orderbys[0]
+								 * argument, required if norderbys > 0 */
 } spgInnerConsistentOut;
 
+typedef struct spgLeafConsistentIn
+{
+	ScanKey	scankeys;	/* operators and arguments, all must be satisfied */
+	int		nkeys;
+	ScanKey	orderbys;	/* ORDER BY operators and arguments */
+	int		norderbys;
+
+	int		level;
+	void	*traversalValue;	/* value stored by parent's inner_consistent */
+	Datum	leafDatum;	/* datum stored in leaf tuple */
+} spgLeafConsistentIn;
+
+typedef struct spgLeafConsistentOut
+{
+	bool	recheck;	/* operators must be rechecked on heap tuple */
+	double	distance;	/* distance to orderbys[0] argument, if norderbys > 0 */
+} spgLeafConsistentOut;
+
 /* spgutils.h */
 void initSpGistState(SpGistState *state, Relation index);
-Buffer SpGistNewBuffer(Relation index);
+Buffer SpGistNewBuffer(Relation index, bool useFSM);
 void SpGistInitBuffer(Buffer b, uint16 f);
 void SpGistInitPage(Page page, uint16 f, Size pageSize);
+bool SpGistPageIsRecyclable(Page page);
 void SpGistInitMetabuffer(Buffer b, Relation index);
+void spgComputeStats(Relation index, SpGistState *state, BufferAccessStrategy strategy,
+						SpGistStats *stats);
+bool spgFormatIsCurrent(Relation index);
+void spgGetStats(Relation index, SpGistStats *stats);
+void spgUpdateStats(Relation index, SpGistStats *stats);
+void spgAddPendingStats(Relation index, SpGistStats *change);
+void spgFlushPendingStats(Relation index);
+void spgRegisterReloptions(void);
 
 unsigned int getTypeLength(SpGistTypeDesc *att, Datum datum);
 SpGistLeafTuple spgFormLeafTuple(SpGistState *state, ItemPointer heapPtr, Datum datum);
@@ -266,4 +465,49 @@ SpGistInnerTuple spgFormInnerTuple(SpGistState *state, bool hasPrefix, Datum pre
 									int nNodes, IndexTuple *nodes);
 
 void spgdoinsert(Relation index, SpGistState *state, ItemPointer heapPtr, Datum datum);
+void spgInsertNull(Relation index, SpGistState *state, ItemPointer heapPtr);
+
+/* spgcache.c */
+extern int spgist_cache_levels;
+SpGistCachedInner *spgGetUpperCache(Relation index, SpGistState *state, bool check);
+bool spgUpperCacheIsValid(Relation index);
+void spgBumpUpperVersion(Relation index, SpGistState *state);
+bool spgCacheDescend(Relation index, SpGistState *state, Datum datum,
+					 BlockNumber *blkno, OffsetNumber *offset, int *level, int *depth);
+
+/* spgxlog.c */
+void spgLogPage(Relation index, SpGistState *state, Buffer buffer);
+void spgLogIndex(Relation index);
+
+/* spgstats.c */
+extern bool spgist_track_stats;
+void *spgStatsHashEntry(HTAB **hash, const char *name, Size keysize, Size entrysize,
+						const void *key);
+void spgReportScanCounters(Relation index, SpGistScanCounters *counters);
+
+/*
+ * Events of the insert path, counted and timed per index when
+ * spgist.track_stats is on
+ */
+typedef enum SpGistInsertEvent
+{
+	SPGIST_EV_INSERT,			/* whole spginsert call */
+	SPGIST_EV_PICKSPLIT,
+	SPGIST_EV_ADDNODE,			/* new node fits in place */
+	SPGIST_EV_ADDNODE_MOVE,		/* inner tuple moved, placeholder left */
+	SPGIST_EV_SPLITTUPLE,
+	SPGIST_EV_RESTART,			/* insert started again from the root */
+	SPGIST_EV_NEWPAGE_FSM,		/* SpGistNewBuffer recycled a page */
+	SPGIST_EV_NEWPAGE_EXTEND,	/* SpGistNewBuffer extended the relation */
+	SPGIST_NEVENTS
+} SpGistInsertEvent;
+
+void spgCountInsertEvent(Relation index, SpGistInsertEvent event, instr_time *start);
+
+#define SPGIST_EVENT_START(t) \
+	do { if (spgist_track_stats) INSTR_TIME_SET_CURRENT(t); } while(0)
+#define SPGIST_EVENT_END(index, event, t) \
+	do { if (spgist_track_stats) spgCountInsertEvent((index), (event), &(t)); } while(0)
+#define SPGIST_EVENT_COUNT(index, event) \
+	do { if (spgist_track_stats) spgCountInsertEvent((index), (event), NULL); } while(0)
 #endif
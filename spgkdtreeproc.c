@@ -0,0 +1,187 @@
+#include "postgres.h"
+
+#include <math.h>
+
+#include "fmgr.h"
+#include "access/gist.h"
+#include "catalog/pg_type.h"
+#include "utils/geo_decls.h"
+#include "spgist.h"
+
+/*
+ * k-d tree over points: every inner tuple splits its points by a single
+ * coordinate, x on even levels and y on odd ones. The coordinate is stored
+ * as float8 prefix and there are two nodes: node 0 holds points with
+ * coordinate <= prefix, node 1 holds points with coordinate >= prefix.
+ */
+
+PG_FUNCTION_INFO_V1(spg_kd_config);
+Datum       spg_kd_config(PG_FUNCTION_ARGS);
+Datum
+spg_kd_config(PG_FUNCTION_ARGS)
+{
+	SpGistOpClassProp	*cfg = palloc(sizeof(*cfg));
+
+	cfg->leafType = POINTOID;
+	cfg->prefixType = FLOAT8OID;
+	cfg->nodeType = INT2OID;
+	PG_RETURN_POINTER(cfg);
+}
+
+#define KDCOORD(p, level)	( ((level) % 2) ? (p)->y : (p)->x )
+
+PG_FUNCTION_INFO_V1(spg_kd_choose);
+Datum       spg_kd_choose(PG_FUNCTION_ARGS);
+Datum
+spg_kd_choose(PG_FUNCTION_ARGS)
+{
+	spgChooseIn		*in = (spgChooseIn*)PG_GETARG_POINTER(0);
+	spgChooseOut	*out = (spgChooseOut*)PG_GETARG_POINTER(1);
+	Point			*inPoint = DatumGetPointP(in->datum);
+	double			coord;
+	Point			*d;
+
+	Assert(in->hasPrefix);
+	Assert(in->nNodes == 2);
+
+	coord = DatumGetFloat8(in->prefixDatum);
+
+	d = palloc(sizeof(*d));
+	*d = *inPoint;
+
+	out->resultType = spgMatchNode;
+	out->result.matchNode.nodeN = (KDCOORD(inPoint, in->level) < coord) ? 0 : 1;
+	out->result.matchNode.levelAdd = 1;
+	out->result.matchNode.restDatum = PointPGetDatum(d);
+
+	PG_RETURN_VOID();
+}
+
+typedef struct SortedPoint
+{
+	Point	*p;
+	int		i;
+} SortedPoint;
+
+static int
+x_cmp(const void *a, const void *b)
+{
+	SortedPoint	*pa = (SortedPoint*)a,
+				*pb = (SortedPoint*)b;
+
+	if (pa->p->x == pb->p->x)
+		return 0;
+	return (pa->p->x > pb->p->x) ? 1 : -1;
+}
+
+static int
+y_cmp(const void *a, const void *b)
+{
+	SortedPoint	*pa = (SortedPoint*)a,
+				*pb = (SortedPoint*)b;
+
+	if (pa->p->y == pb->p->y)
+		return 0;
+	return (pa->p->y > pb->p->y) ? 1 : -1;
+}
+
+/*
+ * Split points in two halves by the median of the level's coordinate. Halves
+ * are assigned by sort position rather than by comparison with the median,
+ * so both nodes get points even when many of them share the coordinate.
+ */
+PG_FUNCTION_INFO_V1(spg_kd_picksplit);
+Datum       spg_kd_picksplit(PG_FUNCTION_ARGS);
+Datum
+spg_kd_picksplit(PG_FUNCTION_ARGS)
+{
+	spgPickSplitIn	*in = (spgPickSplitIn*)PG_GETARG_POINTER(0);
+	spgPickSplitOut	*out = (spgPickSplitOut*)PG_GETARG_POINTER(1);
+	int 			i;
+	int				middle;
+	SortedPoint		*sorted;
+	double			coord;
+
+	sorted = palloc(sizeof(*sorted) * in->nTuples);
+	for(i=0; i<in->nTuples; i++)
+	{
+		sorted[i].p = DatumGetPointP(in->datums[i]);
+		sorted[i].i = i;
+	}
+
+	qsort(sorted, in->nTuples, sizeof(*sorted), (in->level % 2) ? y_cmp : x_cmp);
+	middle = in->nTuples / 2;
+	coord = KDCOORD(sorted[middle].p, in->level);
+
+	out->hasPrefix = true;
+	out->prefixDatum = Float8GetDatum(coord);
+
+	out->nNodes = 2;
+	out->nodeDatums = palloc(sizeof(Datum) * 2);
+	out->nodeDatums[0] = Int16GetDatum((int2)0);
+	out->nodeDatums[1] = Int16GetDatum((int2)1);
+	out->mapTuplesToNodes = palloc(sizeof(int) * in->nTuples);
+	out->leafTupleDatums = palloc(sizeof(Datum) * in->nTuples);
+
+	for(i=0; i<in->nTuples; i++)
+	{
+		Point	*op = palloc(sizeof(*op));
+
+		*op = *sorted[i].p;
+
+		out->leafTupleDatums[ sorted[i].i ] = PointPGetDatum(op);
+		out->mapTuplesToNodes[ sorted[i].i ] = (i < middle) ? 0 : 1;
+	}
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Query point of ~= matches points within EPSILON, so both nodes are
+ * visited when it is that close to the split coordinate.
+ */
+PG_FUNCTION_INFO_V1(spg_kd_inner_consistent);
+Datum       spg_kd_inner_consistent(PG_FUNCTION_ARGS);
+Datum
+spg_kd_inner_consistent(PG_FUNCTION_ARGS)
+{
+	spgInnerConsistentIn	*in = (spgInnerConsistentIn*)PG_GETARG_POINTER(0);
+	spgInnerConsistentOut	*out = (spgInnerConsistentOut*)PG_GETARG_POINTER(1);
+	double					coord;
+	int						which = (1 << 0) | (1 << 1),
+							i;
+
+	Assert(in->hasPrefix);
+	Assert(in->nNodes == 2);
+	coord = DatumGetFloat8(in->prefixDatum);
+
+	for(i=0; i<in->nkeys; i++)
+	{
+		Point	*query = DatumGetPointP(in->scankeys[i].sk_argument);
+		double	q = KDCOORD(query, in->level);
+
+		switch(in->scankeys[i].sk_strategy)
+		{
+			case RTSameStrategyNumber:
+				if (!FPle(q, coord))
+					which &= ~(1 << 0);
+				if (!FPge(q, coord))
+					which &= ~(1 << 1);
+				break;
+			default:
+				elog(ERROR, "unrecognized strategy number: %d",
+					 in->scankeys[i].sk_strategy);
+		}
+	}
+
+	out->levelAdd = 1;
+
+	out->nodeNumbers = palloc(sizeof(int) * 2);
+	out->nNodes = 0;
+
+	for(i=0; i<2; i++)
+		if (which & (1 << i))
+			out->nodeNumbers[out->nNodes++] = i;
+
+	PG_RETURN_VOID();
+}
@@ -1,10 +1,18 @@
 #include "postgres.h"
 
+#include <math.h>
+
 #include "fmgr.h"
+#include "access/gist.h"
 #include "catalog/pg_type.h"
+#include "utils/builtins.h"
 #include "utils/geo_decls.h"
 #include "spgist.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 PG_FUNCTION_INFO_V1(spg_quad_config);
 Datum       spg_quad_config(PG_FUNCTION_ARGS);
 Datum
@@ -18,33 +26,69 @@ spg_quad_config(PG_FUNCTION_ARGS)
 	PG_RETURN_POINTER(cfg);
 }
 
-#define SPTEST(f, c, t)					\
-	DatumGetBool(DirectFunctionCall2(	\
-				point_##f,				\
-				PointPGetDatum(c),		\
-				PointPGetDatum(t)))		\
-
+/*
+ * Quadrant of a point relative to centroid, by fuzzy comparisons (same
+ * EPSILON semantics as point_above(), point_horiz() and friends used by
+ * ~=). Points on the vertical line through centroid go to quadrants 1 and
+ * 2, points on the horizontal line go to quadrants 1 and 3. Index of
+ * quadrantTable is
+ *		FPge(x, cx) | FPge(y, cy) << 1 | FPgt(y, cy) << 2
+ * where combinations 4 and 5 are impossible since FPgt implies FPge.
+ */
+static const int2 quadrantTable[8] = { 3, 2, 3, 1, 4, 1, 4, 1 };
+
+/*
+ * Node label of every node of an inner tuple made by picksplit of equal
+ * points, other inner tuples label nodes by quadrant number - 1. Its
+ * nodes have no regions, choose may pick any of them and scans visit all.
+ */
+#define QUAD_ALLSAME_LABEL		(-1)
+
+#define QUAD_IS_ALLSAME(nodeDatums) \
+	( DatumGetInt16((nodeDatums)[0]) == QUAD_ALLSAME_LABEL )
+
+#define QUADRANT_INDEX(x, y, cx, cy) \
+	( FPge((x), (cx)) | (FPge((y), (cy)) << 1) | (FPgt((y), (cy)) << 2) )
 
 static int2
 getQuadrant(Point *centroid, Point *tst)
 {
-	if ( (SPTEST(above, tst, centroid) || SPTEST(horiz, tst, centroid)) &&
-		 (SPTEST(right, tst, centroid) || SPTEST(vert, tst, centroid)) )
-		return 1;
+	return quadrantTable[QUADRANT_INDEX(tst->x, tst->y, centroid->x, centroid->y)];
+}
 
-	if ( SPTEST(below, tst, centroid) &&
-		 (SPTEST(right, tst, centroid) || SPTEST(vert, tst, centroid)) )
-		return 2;
+/*
+ * Classify n points given as coordinate arrays, quadrant of i-th point is
+ * returned in quadrants[i]. Used by picksplit to process whole page at once.
+ */
+static void
+getQuadrants(Point *centroid, double *x, double *y, int n, int2 *quadrants)
+{
+	int		i = 0;
 
-	if ( (SPTEST(below, tst, centroid) || SPTEST(horiz, tst, centroid))&&
-		 SPTEST(left, tst, centroid) )
-		return 3;
+#ifdef __SSE2__
+	__m128d	cx = _mm_set1_pd(centroid->x),
+			cy = _mm_set1_pd(centroid->y),
+			eps = _mm_set1_pd(EPSILON);
 
-	if ( SPTEST(above, tst, centroid) && SPTEST(left, tst, centroid) )
-		return 4;
+	for(; i + 2 <= n; i += 2)
+	{
+		__m128d	vx = _mm_loadu_pd(x + i),
+				vy = _mm_loadu_pd(y + i);
+		/*
+		 * FPge(A,B) is (A + EPSILON >= B), FPgt(A,B) is (A > B + EPSILON),
+		 * computed in the same order so that rounding is the same too
+		 */
+		int		ge_x = _mm_movemask_pd(_mm_cmpge_pd(_mm_add_pd(vx, eps), cx)),
+				ge_y = _mm_movemask_pd(_mm_cmpge_pd(_mm_add_pd(vy, eps), cy)),
+				gt_y = _mm_movemask_pd(_mm_cmpgt_pd(vy, _mm_add_pd(cy, eps)));
+
+		quadrants[i] = quadrantTable[(ge_x & 1) | ((ge_y & 1) << 1) | ((gt_y & 1) << 2)];
+		quadrants[i + 1] = quadrantTable[(ge_x >> 1) | ((ge_y >> 1) << 1) | ((gt_y >> 1) << 2)];
+	}
+#endif
 
-	elog(ERROR, "getQuadrant: could not be here");
-	return 0;
+	for(; i<n; i++)
+		quadrants[i] = quadrantTable[QUADRANT_INDEX(x[i], y[i], centroid->x, centroid->y)];
 }
 
 
@@ -76,35 +120,76 @@ spg_quad_choose(PG_FUNCTION_ARGS)
 	PG_RETURN_VOID();
 }
 
-PG_FUNCTION_INFO_V1(spg_quad_picksplit);
-Datum       spg_quad_picksplit(PG_FUNCTION_ARGS);
-Datum
-spg_quad_picksplit(PG_FUNCTION_ARGS)
+static int
+cmpDouble(const void *a, const void *b)
+{
+	if ( *(double*)a == *(double*)b )
+		return 0;
+	return ( *(double*)a > *(double*)b ) ? 1 : -1;
+}
+
+/*
+ * Median of n values, v is sorted in place
+ */
+static double
+median(double *v, int n)
+{
+	qsort(v, n, sizeof(double), cmpDouble);
+	return v[n / 2];
+}
+
+/*
+ * Common part of picksplit methods: centroid is either the arithmetic
+ * mean of the points or their per-axis median. The mean is cheaper, but
+ * skewed data (dense clusters among empty space) pulls it away from the
+ * bulk of the points and gives lopsided quadrants; the median gives every
+ * quadrant pair on each axis half of the points. If more than half of the
+ * points share the minimum of both axes the median is that point and puts
+ * every point into quadrant 1, then the mean is used, which separates them
+ * unless all points are the same. Such points would come back as one
+ * chain and fill the page again, so they are dealt out to the four nodes
+ * of an all-same inner tuple instead, see QUAD_ALLSAME_LABEL.
+ */
+static void
+quadPickSplit(spgPickSplitIn *in, spgPickSplitOut *out, bool useMedian)
 {
-	spgPickSplitIn	*in = (spgPickSplitIn*)PG_GETARG_POINTER(0);
-	spgPickSplitOut	*out = (spgPickSplitOut*)PG_GETARG_POINTER(1);
 	int 			i;
 	Point			*centroid;
-	int				nQuadrants[] = {0, 0, 0, 0};
+	double			*x, *y;
+	int2			*quadrants;
+	Point			mean;
+	bool			allSame;
+
+	x = palloc(sizeof(double) * in->nTuples);
+	y = palloc(sizeof(double) * in->nTuples);
+	quadrants = palloc(sizeof(int2) * in->nTuples);
 
-	centroid = palloc(sizeof(*centroid));
+	centroid = palloc0(sizeof(*centroid));
 	for(i=0; i<in->nTuples; i++)
 	{
 		Point	*p = DatumGetPointP(in->datums[i]);
 
-		if (i==0)
-		{
-			*centroid = *p;
-		}
-		else
-		{
-			centroid->x += p->x;
-			centroid->y += p->y;
-		}
+		x[i] = p->x;
+		y[i] = p->y;
+		centroid->x += p->x;
+		centroid->y += p->y;
 	}
 
-	centroid->x /= (double)in->nTuples;
-	centroid->y /= (double)in->nTuples;
+	mean.x = centroid->x / (double)in->nTuples;
+	mean.y = centroid->y / (double)in->nTuples;
+
+	if (useMedian)
+	{
+		double	*tmp = palloc(sizeof(double) * in->nTuples);
+
+		memcpy(tmp, x, sizeof(double) * in->nTuples);
+		centroid->x = median(tmp, in->nTuples);
+		memcpy(tmp, y, sizeof(double) * in->nTuples);
+		centroid->y = median(tmp, in->nTuples);
+		pfree(tmp);
+	}
+	else
+		*centroid = mean;
 
 	out->hasPrefix = true;
 	out->prefixDatum = PointPGetDatum(centroid);
@@ -116,25 +201,61 @@ spg_quad_picksplit(PG_FUNCTION_ARGS)
 	out->mapTuplesToNodes = palloc(sizeof(int) * in->nTuples);
 	out->leafTupleDatums = palloc(sizeof(Datum) * in->nTuples);
 
+	getQuadrants(centroid, x, y, in->nTuples, quadrants);
+
+	if (useMedian)
+	{
+		for(i=1; i<in->nTuples; i++)
+			if (quadrants[i] != quadrants[0])
+				break;
+		if (i >= in->nTuples)
+		{
+			*centroid = mean;
+			getQuadrants(centroid, x, y, in->nTuples, quadrants);
+		}
+	}
+
+	for(i=1; i<in->nTuples; i++)
+		if (quadrants[i] != quadrants[0])
+			break;
+	allSame = (i >= in->nTuples);
+
+	if (allSame)
+		for(i=0; i<4; i++)
+			out->nodeDatums[i] = Int16GetDatum((int2)QUAD_ALLSAME_LABEL);
+
 	for(i=0; i<in->nTuples; i++)
 	{
-		Point   *p = DatumGetPointP(in->datums[i]), *op;
-		int2	quadrant = getQuadrant(centroid, p) - 1;
+		Point   *op;
 
 		op = palloc(sizeof(*op));
-		*op = *p;
+		op->x = x[i];
+		op->y = y[i];
 
 		out->leafTupleDatums[ i ] = PointPGetDatum(op);
-		out->mapTuplesToNodes[ i ] = quadrant;
-		nQuadrants[quadrant]++;
+		out->mapTuplesToNodes[ i ] = (allSame) ? i % 4 : quadrants[i] - 1;
 	}
+}
 
-	for(i=0; i<4; i++)
-	{
-		if (nQuadrants[i] == in->nTuples)
-			elog(ERROR, "Could not support some strange corner cases, will fix in future");
-	}
+PG_FUNCTION_INFO_V1(spg_quad_picksplit);
+Datum       spg_quad_picksplit(PG_FUNCTION_ARGS);
+Datum
+spg_quad_picksplit(PG_FUNCTION_ARGS)
+{
+	quadPickSplit((spgPickSplitIn*)PG_GETARG_POINTER(0),
+				  (spgPickSplitOut*)PG_GETARG_POINTER(1),
+				  false);
+	PG_RETURN_VOID();
+}
 
+PG_FUNCTION_INFO_V1(spg_quad_picksplit_median);
+Datum       spg_quad_picksplit_median(PG_FUNCTION_ARGS);
+Datum
+spg_quad_picksplit_median(PG_FUNCTION_ARGS)
+{
+	quadPickSplit((spgPickSplitIn*)PG_GETARG_POINTER(0),
+				  (spgPickSplitOut*)PG_GETARG_POINTER(1),
+				  true);
 	PG_RETURN_VOID();
 }
 
@@ -143,16 +264,156 @@ Datum       spg_quad_leaf_consistent(PG_FUNCTION_ARGS);
 Datum
 spg_quad_leaf_consistent(PG_FUNCTION_ARGS)
 {
-	/*int		level = PG_GETARG_INT32(0);*/
-	Point	*query = PG_GETARG_POINT_P(1);
-	Point	*datum = PG_GETARG_POINT_P(2);
-	bool	res;
+	spgLeafConsistentIn		*in = (spgLeafConsistentIn*)PG_GETARG_POINTER(0);
+	spgLeafConsistentOut	*out = (spgLeafConsistentOut*)PG_GETARG_POINTER(1);
+	Point					*datum = DatumGetPointP(in->leafDatum);
+	bool					res = true;
+	int						i;
 
-	res = SPTEST(eq, datum, query);
+	out->recheck = false;
+
+	for(i=0; res && i<in->nkeys; i++)
+	{
+		Point	*query;
+		BOX		*box;
+
+		switch(in->scankeys[i].sk_strategy)
+		{
+			case RTLeftStrategyNumber:
+				query = DatumGetPointP(in->scankeys[i].sk_argument);
+				res = FPlt(datum->x, query->x);
+				break;
+			case RTRightStrategyNumber:
+				query = DatumGetPointP(in->scankeys[i].sk_argument);
+				res = FPgt(datum->x, query->x);
+				break;
+			case RTSameStrategyNumber:
+				query = DatumGetPointP(in->scankeys[i].sk_argument);
+				res = FPeq(datum->x, query->x) && FPeq(datum->y, query->y);
+				break;
+			case RTBelowStrategyNumber:
+				query = DatumGetPointP(in->scankeys[i].sk_argument);
+				res = FPlt(datum->y, query->y);
+				break;
+			case RTAboveStrategyNumber:
+				query = DatumGetPointP(in->scankeys[i].sk_argument);
+				res = FPgt(datum->y, query->y);
+				break;
+			case RTContainedByStrategyNumber:
+				/* on_pb() compares exactly, without EPSILON */
+				box = DatumGetBoxP(in->scankeys[i].sk_argument);
+				res = datum->x >= box->low.x && datum->x <= box->high.x &&
+					  datum->y >= box->low.y && datum->y <= box->high.y;
+				break;
+			default:
+				elog(ERROR, "unrecognized strategy number: %d",
+					 in->scankeys[i].sk_strategy);
+		}
+	}
+
+	if (res && in->norderbys > 0)
+	{
+		Point	*query = DatumGetPointP(in->orderbys[0].sk_argument);
+
+		out->distance = HYPOT(datum->x - query->x, datum->y - query->y);
+	}
 
 	PG_RETURN_BOOL(res);
 }
 
+/*
+ * Bitmask of quadrants (bit n for quadrant n) which may contain points
+ * inside box. Quadrant bounds follow getQuadrant(): quadrants 1 and 2 have
+ * x >= cx - EPSILON, 3 and 4 have x < cx - EPSILON, 1 has y >= cy - EPSILON,
+ * 2 has y < cy - EPSILON, 3 has y <= cy + EPSILON, 4 has y > cy + EPSILON.
+ */
+static int
+quadrantsInBox(Point *centroid, BOX *box)
+{
+	int		which = (1 << 1) | (1 << 2) | (1 << 3) | (1 << 4);
+
+	if (box->high.x < centroid->x - EPSILON)
+		which &= ~((1 << 1) | (1 << 2));
+	if (box->low.x >= centroid->x - EPSILON)
+		which &= ~((1 << 3) | (1 << 4));
+	if (box->high.y < centroid->y - EPSILON)
+		which &= ~(1 << 1);
+	if (box->low.y >= centroid->y - EPSILON)
+		which &= ~(1 << 2);
+	if (box->low.y > centroid->y + EPSILON)
+		which &= ~(1 << 3);
+	if (box->high.y <= centroid->y + EPSILON)
+		which &= ~(1 << 4);
+
+	return which;
+}
+
+/*
+ * Region of a quadrant: the parent's region (NULL means the whole plane)
+ * cut by the quadrant bounds listed above. Bounds are closed, so the
+ * region may only be a little too large, which is fine for a lower bound
+ * of distance. Quadrant 0 is a node of an all-same tuple and keeps the
+ * parent's region, centroid is not used then.
+ */
+static BOX *
+quadrantBox(Point *centroid, BOX *parent, int quadrant)
+{
+	BOX		*box = palloc(sizeof(*box));
+
+	if (parent)
+		*box = *parent;
+	else
+	{
+		box->low.x = box->low.y = -get_float8_infinity();
+		box->high.x = box->high.y = get_float8_infinity();
+	}
+
+	if (quadrant == 0)
+		return box;
+
+	if (quadrant == 1 || quadrant == 2)
+		box->low.x = Max(box->low.x, centroid->x - EPSILON);
+	else
+		box->high.x = Min(box->high.x, centroid->x - EPSILON);
+
+	switch(quadrant)
+	{
+		case 1:
+			box->low.y = Max(box->low.y, centroid->y - EPSILON);
+			break;
+		case 2:
+			box->high.y = Min(box->high.y, centroid->y - EPSILON);
+			break;
+		case 3:
+			box->high.y = Min(box->high.y, centroid->y + EPSILON);
+			break;
+		case 4:
+			box->low.y = Max(box->low.y, centroid->y + EPSILON);
+			break;
+	}
+
+	return box;
+}
+
+static double
+pointToBoxDistance(Point *point, BOX *box)
+{
+	double	dx = 0.0,
+			dy = 0.0;
+
+	if (point->x < box->low.x)
+		dx = box->low.x - point->x;
+	else if (point->x > box->high.x)
+		dx = point->x - box->high.x;
+
+	if (point->y < box->low.y)
+		dy = box->low.y - point->y;
+	else if (point->y > box->high.y)
+		dy = point->y - box->high.y;
+
+	return HYPOT(dx, dy);
+}
+
 PG_FUNCTION_INFO_V1(spg_quad_inner_consistent);
 Datum       spg_quad_inner_consistent(PG_FUNCTION_ARGS);
 Datum
@@ -160,20 +421,101 @@ spg_quad_inner_consistent(PG_FUNCTION_ARGS)
 {
 	spgInnerConsistentIn	*in = (spgInnerConsistentIn*)PG_GETARG_POINTER(0);
 	spgInnerConsistentOut	*out = (spgInnerConsistentOut*)PG_GETARG_POINTER(1);
-	Point					*query,
-							*centroid;
+	Point					*centroid;
+	int						which = (1 << 1) | (1 << 2) | (1 << 3) | (1 << 4),
+							i;
 
-	query = DatumGetPointP(in->query);
 	Assert(in->hasPrefix);
 	centroid = DatumGetPointP(in->prefixDatum);
 
+	/* every node of an all-same tuple may hold any point */
+	for(i=0; which && i<in->nkeys && !QUAD_IS_ALLSAME(in->nodeDatums); i++)
+	{
+		Point	*query;
+		BOX		box;
+
+		switch(in->scankeys[i].sk_strategy)
+		{
+			case RTLeftStrategyNumber:
+				/* quadrants 1 and 2 have x >= cx - EPSILON */
+				query = DatumGetPointP(in->scankeys[i].sk_argument);
+				if (centroid->x >= query->x)
+					which &= (1 << 3) | (1 << 4);
+				break;
+			case RTRightStrategyNumber:
+				/* quadrants 3 and 4 have x < cx - EPSILON */
+				query = DatumGetPointP(in->scankeys[i].sk_argument);
+				if (centroid->x <= query->x)
+					which &= (1 << 1) | (1 << 2);
+				break;
+			case RTSameStrategyNumber:
+				query = DatumGetPointP(in->scankeys[i].sk_argument);
+				box.low.x = query->x - EPSILON;
+				box.low.y = query->y - EPSILON;
+				box.high.x = query->x + EPSILON;
+				box.high.y = query->y + EPSILON;
+				which &= quadrantsInBox(centroid, &box);
+				break;
+			case RTBelowStrategyNumber:
+				/* quadrants 1 and 4 have y >= cy - EPSILON */
+				query = DatumGetPointP(in->scankeys[i].sk_argument);
+				if (centroid->y >= query->y)
+					which &= (1 << 2) | (1 << 3);
+				break;
+			case RTAboveStrategyNumber:
+				/* quadrants 2 and 3 have y <= cy + EPSILON */
+				query = DatumGetPointP(in->scankeys[i].sk_argument);
+				if (centroid->y <= query->y)
+					which &= (1 << 1) | (1 << 4);
+				break;
+			case RTContainedByStrategyNumber:
+				which &= quadrantsInBox(centroid,
+										DatumGetBoxP(in->scankeys[i].sk_argument));
+				break;
+			default:
+				elog(ERROR, "unrecognized strategy number: %d",
+					 in->scankeys[i].sk_strategy);
+		}
+	}
 
 	out->levelAdd = 0;
 
-	out->nodeNumbers = palloc(sizeof(int));
-	out->nNodes = 1;
-	out->nodeNumbers[0] = getQuadrant(centroid, query) - 1;
+	out->nodeNumbers = palloc(sizeof(int) * 4);
+	out->nNodes = 0;
+
+	for(i=1; i<=4; i++)
+		if (which & (1 << i))
+			out->nodeNumbers[out->nNodes++] = i - 1;
+
+	/*
+	 * For ORDER BY <-> each node gets its region as traversal value and
+	 * distance from the region to the argument as lower bound.
+	 */
+	if (in->norderbys > 0 && out->nNodes > 0)
+	{
+		Point			*query = DatumGetPointP(in->orderbys[0].sk_argument);
+		MemoryContext	oldCtx;
+
+		out->distances = palloc(sizeof(double) * out->nNodes);
+
+		oldCtx = MemoryContextSwitchTo(in->traversalMemoryContext);
+		out->traversalValues = palloc(sizeof(void*) * out->nNodes);
+
+		for(i=0; i<out->nNodes; i++)
+		{
+			BOX		*box;
+
+			if (QUAD_IS_ALLSAME(in->nodeDatums))
+				box = quadrantBox(NULL, (BOX*)in->traversalValue, 0);
+			else
+				box = quadrantBox(centroid, (BOX*)in->traversalValue,
+								  out->nodeNumbers[i] + 1);
+
+			out->traversalValues[i] = box;
+			out->distances[i] = pointToBoxDistance(query, box);
+		}
+		MemoryContextSwitchTo(oldCtx);
+	}
 
 	PG_RETURN_VOID();
 }
-
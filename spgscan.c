@@ -5,6 +5,7 @@
 #include "miscadmin.h"
 #include "storage/bufmgr.h"
 #include "storage/lmgr.h"
+#include "utils/builtins.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
 
@@ -17,19 +18,24 @@ spgbeginscan(PG_FUNCTION_ARGS)
 {
     Relation    rel = (Relation) PG_GETARG_POINTER(0);
 	int         keysz = PG_GETARG_INT32(1);
-	/* ScanKey     scankey = (ScanKey) PG_GETARG_POINTER(2); */
+	int         norderbys = PG_GETARG_INT32(2);
 	IndexScanDesc scan;
 	SpGistScanOpaque so;
 
-	scan = RelationGetIndexScan(rel, keysz, 0);
+	scan = RelationGetIndexScan(rel, keysz, norderbys);
 
-	so = (SpGistScanOpaque) palloc(sizeof(SpGistScanOpaqueData));
+	so = (SpGistScanOpaque) palloc0(sizeof(SpGistScanOpaqueData));
 	initSpGistState(&so->state, scan->indexRelation);
 	so->tempCxt = AllocSetContextCreate(CurrentMemoryContext,
 										"SpGist search temporary context",
 										ALLOCSET_DEFAULT_MINSIZE,
 										ALLOCSET_DEFAULT_INITSIZE,
 										ALLOCSET_DEFAULT_MAXSIZE);
+	so->queueCxt = AllocSetContextCreate(CurrentMemoryContext,
+										"SpGist search queue context",
+										ALLOCSET_DEFAULT_MINSIZE,
+										ALLOCSET_DEFAULT_INITSIZE,
+										ALLOCSET_DEFAULT_MAXSIZE);
 	scan->opaque = so;
 
 	PG_RETURN_POINTER(scan);
@@ -41,18 +47,44 @@ Datum
 spgrescan(PG_FUNCTION_ARGS)
 {
     IndexScanDesc scan = (IndexScanDesc) PG_GETARG_POINTER(0);
-	/* SpGistScanOpaque so = (SpGistScanOpaque) scan->opaque; */
+	SpGistScanOpaque so = (SpGistScanOpaque) scan->opaque;
 	ScanKey     scankey = (ScanKey) PG_GETARG_POINTER(1);
+	ScanKey     orderbys = (ScanKey) PG_GETARG_POINTER(3);
+	int			i;
 
+	/* keys are ANDed, opclass consistent functions check all of them */
 	if (scankey && scan->numberOfKeys > 0)
 	{
-		if (scan->numberOfKeys != 1)
-			elog(ERROR, "SPGIST doesn;t support multiple operation (yet)");
-
 		memmove(scan->keyData, scankey,
 				scan->numberOfKeys * sizeof(ScanKeyData));
 	}
 
+	/*
+	 * Operators are strict, so a NULL key (e.g. an element of = ANY) matches
+	 * nothing, and consistent functions don't expect one
+	 */
+	so->keyIsNull = false;
+	for(i=0; i<scan->numberOfKeys; i++)
+		if (scan->keyData[i].sk_flags & SK_ISNULL)
+			so->keyIsNull = true;
+
+	if (orderbys && scan->numberOfOrderBys > 0)
+	{
+		if (scan->numberOfOrderBys != 1)
+			elog(ERROR, "SPGIST supports only one ORDER BY operator");
+
+		memmove(scan->orderByData, orderbys,
+				scan->numberOfOrderBys * sizeof(ScanKeyData));
+	}
+
+	spgReportScanCounters(scan->indexRelation, &so->counters);
+
+	MemoryContextReset(so->queueCxt);
+	so->ordered = (scan->numberOfOrderBys > 0);
+	so->started = false;
+	so->items = NULL;
+	so->nItems = so->maxItems = 0;
+
 	PG_RETURN_VOID();
 }
 
@@ -64,7 +96,10 @@ spgendscan(PG_FUNCTION_ARGS)
 	IndexScanDesc scan = (IndexScanDesc) PG_GETARG_POINTER(0);
 	SpGistScanOpaque so = (SpGistScanOpaque) scan->opaque;
 
+	spgReportScanCounters(scan->indexRelation, &so->counters);
+
 	MemoryContextDelete(so->tempCxt);
+	MemoryContextDelete(so->queueCxt);
 
 	PG_RETURN_VOID();
 }
@@ -87,44 +122,366 @@ spgrestrpos(PG_FUNCTION_ARGS)
 	PG_RETURN_VOID();
 }
 
-static bool
-spgLeafTest(SpGistState *state, MemoryContext ctx, SpGistLeafTuple tuple, int level, TIDBitmap *tbm, Datum datum)
+/*
+ * Queue of search items. Depth-first stack for plain scans; for ordered
+ * scans a binary heap with the smallest distance on top, heap tuples go
+ * before pages at equal distance so results are returned as soon as
+ * possible.
+ */
+#define ITEMLESS(a, b) \
+	( (a)->distance < (b)->distance || \
+	  ((a)->distance == (b)->distance && (a)->isHeapTuple && !(b)->isHeapTuple) )
+
+static void
+spgAddSearchItem(SpGistScanOpaque so, SpGistSearchItem *item)
+{
+	int		i;
+
+	if (so->nItems >= so->maxItems)
+	{
+		if (so->items == NULL)
+		{
+			so->maxItems = 64;
+			so->items = MemoryContextAlloc(so->queueCxt,
+										   sizeof(SpGistSearchItem*) * so->maxItems);
+		}
+		else
+		{
+			so->maxItems *= 2;
+			so->items = repalloc(so->items, sizeof(SpGistSearchItem*) * so->maxItems);
+		}
+	}
+
+	i = so->nItems++;
+
+	if (so->ordered)
+	{
+		while(i > 0)
+		{
+			int		parent = (i - 1) / 2;
+
+			if (!ITEMLESS(item, so->items[parent]))
+				break;
+			so->items[i] = so->items[parent];
+			i = parent;
+		}
+	}
+
+	so->items[i] = item;
+}
+
+static SpGistSearchItem *
+spgGetNextSearchItem(SpGistScanOpaque so)
+{
+	SpGistSearchItem	*result,
+						*last;
+	int					i = 0;
+
+	if (so->nItems == 0)
+		return NULL;
+
+	if (!so->ordered)
+		return so->items[--so->nItems];
+
+	result = so->items[0];
+	last = so->items[--so->nItems];
+
+	for(;;)
+	{
+		int		child = 2 * i + 1;
+
+		if (child >= so->nItems)
+			break;
+		if (child + 1 < so->nItems && ITEMLESS(so->items[child + 1], so->items[child]))
+			child++;
+		if (!ITEMLESS(so->items[child], last))
+			break;
+		so->items[i] = so->items[child];
+		i = child;
+	}
+
+	if (so->nItems > 0)
+		so->items[i] = last;
+
+	return result;
+}
+
+static SpGistSearchItem *
+spgNewSearchItem(SpGistScanOpaque so)
+{
+	return (SpGistSearchItem*) MemoryContextAllocZero(so->queueCxt,
+													  sizeof(SpGistSearchItem));
+}
+
+/*
+ * Traversal value is used only by the item's own inner_consistent or
+ * leaf_consistent calls, children get their own ones
+ */
+static void
+spgFreeSearchItem(SpGistSearchItem *item)
+{
+	if (item->traversalValue)
+		pfree(item->traversalValue);
+	pfree(item);
+}
+
+static void
+spgStartSearch(IndexScanDesc scan)
+{
+	SpGistScanOpaque	so = (SpGistScanOpaque) scan->opaque;
+	SpGistSearchItem	*item;
+
+	/*
+	 * NULLs match no key. Scans without keys, e.g. by CLUSTER or by ORDER BY
+	 * alone, return them after everything else: at infinite distance, or
+	 * from the bottom of the stack.
+	 */
+	if (scan->numberOfKeys == 0)
+	{
+		item = spgNewSearchItem(so);
+		item->isNulls = true;
+		item->blkno = SPGIST_NULLS_BLKNO;
+		item->offset = InvalidOffsetNumber;
+		item->distance = get_float8_infinity();
+		spgAddSearchItem(so, item);
+	}
+
+	item = spgNewSearchItem(so);
+	item->blkno = SPGIST_HEAD_BLKNO;
+	item->offset = InvalidOffsetNumber;
+	item->level = 0;
+	item->depth = 0;
+	item->traversalValue = NULL;
+	item->distance = 0.0;
+	item->cached = spgGetUpperCache(scan->indexRelation, &so->state, true);
+	if (item->cached && !item->cached->allInner)
+		item->cached = NULL;
+
+	spgAddSearchItem(so, item);
+	so->started = true;
+	so->counters.scans++;
+}
+
+/*
+ * Matching heap pointer goes to the bitmap for bitmap scans, and to the
+ * queue for gettuple scans.
+ */
+static void
+spgStoreResult(SpGistScanOpaque so, ItemPointer heapPtr, bool recheck, double distance)
 {
-	bool 			result;
-	MemoryContext	oldCtx;
+	if (so->tbm)
+	{
+		tbm_add_tuples(so->tbm, heapPtr, 1, recheck);
+		so->ntids++;
+	}
+	else
+	{
+		SpGistSearchItem	*item = spgNewSearchItem(so);
+
+		item->isHeapTuple = true;
+		item->heapPtr = *heapPtr;
+		item->recheck = recheck;
+		item->distance = distance;
+
+		spgAddSearchItem(so, item);
+	}
+}
+
+static void
+spgLeafTest(IndexScanDesc scan, SpGistSearchItem *item, SpGistLeafTuple tuple)
+{
+	SpGistScanOpaque		so = (SpGistScanOpaque) scan->opaque;
+	bool 					result;
+	MemoryContext			oldCtx;
+	spgLeafConsistentIn		in;
+	spgLeafConsistentOut	out;
+
+	in.scankeys = scan->keyData;
+	in.nkeys = scan->numberOfKeys;
+	in.orderbys = scan->orderByData;
+	in.norderbys = scan->numberOfOrderBys;
+	in.level = item->level;
+	in.traversalValue = item->traversalValue;
+	in.leafDatum = SGLTDATUM(tuple, &so->state);
+	out.recheck = false;
+	out.distance = 0.0;
 	
-	oldCtx = MemoryContextSwitchTo(ctx);
-	result = DatumGetBool(FunctionCall3(&state->leafConsistentFn,
-										Int32GetDatum(level),
-										datum,
-										SGLTDATUM(tuple, state)));
+	oldCtx = MemoryContextSwitchTo(so->tempCxt);
+	result = DatumGetBool(FunctionCall2(&so->state.leafConsistentFn,
+										PointerGetDatum(&in),
+										PointerGetDatum(&out)));
 	MemoryContextSwitchTo(oldCtx);
 
+	so->counters.leafTested++;
 	if (result)
 	{
-#if 0
-		elog(NOTICE, "AA %u:%u", 
-						ItemPointerGetBlockNumber(&tuple->heapPtr),
-						ItemPointerGetOffsetNumber(&tuple->heapPtr));
-#endif
-		tbm_add_tuples(tbm, &tuple->heapPtr, 1, false);
+		so->counters.leafMatched++;
+		spgStoreResult(so, &tuple->heapPtr, out.recheck, out.distance);
 	}
+}
 
-	return result;
+/*
+ * Call inner_consistent for the inner tuple of item, given by its prefix
+ * and labels in in, and queue matching children
+ */
+static void
+spgInnerTest(IndexScanDesc scan, SpGistSearchItem *item, spgInnerConsistentIn *in,
+			 ItemPointer childPtrs, SpGistCachedInner **children)
+{
+	SpGistScanOpaque		so = (SpGistScanOpaque) scan->opaque;
+	spgInnerConsistentOut	out;
+	MemoryContext			oldCtx;
+	int						i;
+
+	in->scankeys = scan->keyData;
+	in->nkeys = scan->numberOfKeys;
+	in->orderbys = scan->orderByData;
+	in->norderbys = scan->numberOfOrderBys;
+	in->level = item->level;
+	in->traversalValue = item->traversalValue;
+	in->traversalMemoryContext = so->queueCxt;
+
+	out.traversalValues = NULL;
+	out.distances = NULL;
+
+	oldCtx = MemoryContextSwitchTo(so->tempCxt);
+	FunctionCall2(&so->state.innerConsistentFn,
+					PointerGetDatum(in),
+					PointerGetDatum(&out));
+	MemoryContextSwitchTo(oldCtx);
+
+	so->counters.innerTuples++;
+	so->counters.nodesSelected += out.nNodes;
+
+	if (so->ordered && out.nNodes > 0 && out.distances == NULL)
+		elog(ERROR, "inner_consistent didn't return distances for ordered scan");
+
+	/*
+	 * Queue in reverse order, so depth-first traversal of plain scans
+	 * visits nodes in the order of inner tuple
+	 */
+	for(i=out.nNodes - 1; i>=0; i--)
+	{
+		SpGistSearchItem	*child;
+		int					n = out.nodeNumbers[i];
+
+		/* picksplit leaves nodes without tuples unlinked */
+		if (!ItemPointerIsValid(&childPtrs[n]))
+			continue;
+
+		child = spgNewSearchItem(so);
+		child->blkno = ItemPointerGetBlockNumber(&childPtrs[n]);
+		child->offset = ItemPointerGetOffsetNumber(&childPtrs[n]);
+		child->level = item->level + out.levelAdd;
+		child->depth = item->depth + 1;
+		child->traversalValue = (out.traversalValues) ? out.traversalValues[i] : NULL;
+		child->distance = (so->ordered) ? out.distances[i] : 0.0;
+		if (children && children[n] && children[n]->allInner)
+			child->cached = children[n];
+
+		spgAddSearchItem(so, child);
+	}
 }
 
+/*
+ * Return every tuple of a page of the NULLs list and queue the next page
+ */
+static void
+spgWalkNulls(IndexScanDesc scan, SpGistSearchItem *item)
+{
+	SpGistScanOpaque	so = (SpGistScanOpaque) scan->opaque;
+	Buffer				buffer;
+	Page				page;
+	OffsetNumber		offset;
+	BlockNumber			next;
+
+	buffer = ReadBuffer(scan->indexRelation, item->blkno);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buffer);
+
+	so->counters.pages++;
+
+	if (PageIsNew(page) || !SpGistPageIsNulls(page))
+		elog(ERROR, "SP-GiST index \"%s\" has no page of NULLs at block %u",
+			 RelationGetRelationName(scan->indexRelation), item->blkno);
+
+	for(offset=FirstOffsetNumber; offset<=SpGistPageGetMaxOffset(page); offset++)
+	{
+		SpGistLeafTuple	leafTuple;
+
+		leafTuple = (SpGistLeafTuple) PageGetItem(page, PageGetItemId(page, offset));
+		spgStoreResult(so, &leafTuple->heapPtr, false, item->distance);
+	}
+
+	next = SpGistPageGetOpaque(page)->nextBlkno;
+	UnlockReleaseBuffer(buffer);
+
+	if (next != InvalidBlockNumber)
+	{
+		SpGistSearchItem	*child = spgNewSearchItem(so);
 
+		child->isNulls = true;
+		child->blkno = next;
+		child->offset = InvalidOffsetNumber;
+		child->distance = item->distance;
+		spgAddSearchItem(so, child);
+	}
+}
+
+/*
+ * Process page pointed by item: test leaf chain or call inner_consistent
+ * and queue matching children. Cached inner tuples are processed without
+ * reading their page.
+ *
+ * Only one page is locked at a time, so the location may have changed
+ * since the item was queued. Inner tuples stay at their offset, except
+ * moves by addNode which leave a redirect. Split leaf pages are only
+ * marked deleted and keep the chain, they are not reused while we may
+ * still be running. Anything else is corruption.
+ */
 static void
-spgsearch(Relation index, SpGistScanOpaque so, TIDBitmap *tbm, int64 *ntids, 
-			Datum datum, int level, BlockNumber blkno, OffsetNumber offset)
+spgWalk(IndexScanDesc scan, SpGistSearchItem *item)
 {
-	Buffer			buffer;
-	Page			page;
+	SpGistScanOpaque	so = (SpGistScanOpaque) scan->opaque;
+	Buffer				buffer;
+	Page				page;
+	OffsetNumber		offset = item->offset;
+
+	so->counters.maxDepth = Max(so->counters.maxDepth, item->depth);
 
-	buffer = ReadBuffer(index, blkno);
+	if (item->isNulls)
+	{
+		spgWalkNulls(scan, item);
+		return;
+	}
+
+	if (item->cached)
+	{
+		spgInnerConsistentIn	in;
+
+		in.hasPrefix = item->cached->hasPrefix;
+		in.prefixDatum = item->cached->prefixDatum;
+		in.nNodes = item->cached->nNodes;
+		in.nodeDatums = item->cached->nodeDatums;
+
+		spgInnerTest(scan, item, &in, item->cached->childPtrs, item->cached->children);
+
+		MemoryContextReset(so->tempCxt);
+		return;
+	}
+
+redirect:
+	buffer = ReadBuffer(scan->indexRelation, item->blkno);
 	LockBuffer(buffer, BUFFER_LOCK_SHARE);
 	page = BufferGetPage(buffer);
 
+	so->counters.pages++;
+
+	if (PageIsNew(page) || SpGistPageIsMeta(page) ||
+		offset > SpGistPageGetMaxOffset(page))
+		elog(ERROR, "SP-GiST index \"%s\" has no tuple at block %u offset %u",
+			 RelationGetRelationName(scan->indexRelation), item->blkno, offset);
+
 	if (SpGistPageIsLeaf(page))
 	{
 		SpGistLeafTuple 	leafTuple;
@@ -135,90 +492,69 @@ spgsearch(Relation index, SpGistScanOpaque so, TIDBitmap *tbm, int64 *ntids,
 			{
 				leafTuple = (SpGistLeafTuple) PageGetItem(page, PageGetItemId(page, offset));
 
-				(*ntids) += !!spgLeafTest(&so->state, so->tempCxt, leafTuple, level, tbm, datum);
+				spgLeafTest(scan, item, leafTuple);
 			}
 		}
 		else
 		{
 			while(offset != InvalidOffsetNumber)
 			{
+				if (offset > SpGistPageGetMaxOffset(page))
+					elog(ERROR, "SP-GiST index \"%s\" has broken chain at block %u",
+						 RelationGetRelationName(scan->indexRelation), item->blkno);
+
 				leafTuple = (SpGistLeafTuple) PageGetItem(page, PageGetItemId(page, offset));
 
-				(*ntids) += !!spgLeafTest(&so->state, so->tempCxt, leafTuple, level, tbm, datum);
+				spgLeafTest(scan, item, leafTuple);
 
 				offset = leafTuple->nextOffset; 
 			}
 		}
-
-		MemoryContextReset(so->tempCxt);
 	} 
 	else 
 	{
 		SpGistInnerTuple		innerTuple;
 		spgInnerConsistentIn	in;
-		spgInnerConsistentOut	out;
-		IndexTuple				*nodes, node;
-		int						i, *nodeNumbers, nNodes;
-		MemoryContext			oldCtx;
+		ItemPointerData			*childPtrs;
+		IndexTuple				node;
+		int						i;
 
+		/* the root leaf page may have become inner since queued */
 		if (offset == InvalidOffsetNumber)
 			offset = FirstOffsetNumber;
-		i = SpGistPageGetMaxOffset(page);
-		Assert( offset <= SpGistPageGetMaxOffset(page));
 
 		innerTuple = (SpGistInnerTuple) PageGetItem(page, PageGetItemId(page, offset));
 
-		in.query = datum;
-		in.level = level;
+		if (SGITISREDIRECT(innerTuple))
+		{
+			item->blkno = ItemPointerGetBlockNumber(SGITREDIRECT(innerTuple));
+			item->offset = offset = ItemPointerGetOffsetNumber(SGITREDIRECT(innerTuple));
+			UnlockReleaseBuffer(buffer);
+			goto redirect;
+		}
+
 		in.hasPrefix = innerTuple->hasPrefix;
 		in.prefixDatum = SGITDATUM(innerTuple, &so->state);
 		in.nNodes = innerTuple->nNodes;
-		nodes = palloc(sizeof(IndexTuple) * in.nNodes); 
 
-		oldCtx = MemoryContextSwitchTo(so->tempCxt);
-		in.nodeDatums = palloc(sizeof(Datum) * in.nNodes);
+		childPtrs = MemoryContextAlloc(so->tempCxt, sizeof(ItemPointerData) * in.nNodes);
+		in.nodeDatums = MemoryContextAlloc(so->tempCxt, sizeof(Datum) * in.nNodes);
 
 		SGITITERATE(innerTuple, &so->state, i, node)
 		{
 			bool	isnull;
 
-			nodes[i] = node;
+			childPtrs[i] = node->t_tid;
 			in.nodeDatums[i] = index_getattr(node, 1, so->state.nodeTupDesc, &isnull);
 		}
-		
-		FunctionCall2(&so->state.innerConsistentFn,
-						PointerGetDatum(&in),
-						PointerGetDatum(&out));
-		MemoryContextSwitchTo(oldCtx);
 
-		nNodes = out.nNodes;
-
-		if (nNodes > 0)
-		{
-			nodeNumbers = palloc(sizeof(int) * nNodes);
-			memcpy(nodeNumbers, out.nodeNumbers, nNodes * sizeof(int));
-		}
-
-		MemoryContextReset(so->tempCxt);
-
-		level += out.levelAdd;
-
-		for(i=0; i<nNodes; i++)
-		{
-			spgsearch(index, so, tbm, ntids, datum, level, 
-						ItemPointerGetBlockNumber(&nodes[nodeNumbers[i]]->t_tid),
-						ItemPointerGetOffsetNumber(&nodes[nodeNumbers[i]]->t_tid));
-		}
-
-		if (nNodes > 0)
-			pfree(nodeNumbers);
-		pfree(nodes);
+		spgInnerTest(scan, item, &in, childPtrs, NULL);
 	}
 
+	MemoryContextReset(so->tempCxt);
 	UnlockReleaseBuffer(buffer);
 }
 
-
 PG_FUNCTION_INFO_V1(spggetbitmap);
 Datum       spggetbitmap(PG_FUNCTION_ARGS);
 Datum
@@ -226,12 +562,62 @@ spggetbitmap(PG_FUNCTION_ARGS)
 {
 	IndexScanDesc 			scan = (IndexScanDesc) PG_GETARG_POINTER(0);
 	TIDBitmap  				*tbm = (TIDBitmap *) PG_GETARG_POINTER(1);
-	int64					ntids = 0;
 	SpGistScanOpaque 		so = (SpGistScanOpaque) scan->opaque;
+	SpGistSearchItem		*item;
+
+	so->tbm = tbm;
+	so->ntids = 0;
+
+	if (so->keyIsNull)
+		PG_RETURN_INT64(0);
+
+	spgStartSearch(scan);
 
-	spgsearch(scan->indexRelation, so, tbm, &ntids, 
-			scan->keyData->sk_argument, 0, SPGIST_HEAD_BLKNO, InvalidOffsetNumber);
+	while((item = spgGetNextSearchItem(so)) != NULL)
+	{
+		spgWalk(scan, item);
+		spgFreeSearchItem(item);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	so->tbm = NULL;
 	
-	PG_RETURN_INT64(ntids);
+	PG_RETURN_INT64(so->ntids);
 }
 
+PG_FUNCTION_INFO_V1(spggettuple);
+Datum       spggettuple(PG_FUNCTION_ARGS);
+Datum
+spggettuple(PG_FUNCTION_ARGS)
+{
+	IndexScanDesc 			scan = (IndexScanDesc) PG_GETARG_POINTER(0);
+	ScanDirection			dir = (ScanDirection) PG_GETARG_INT32(1);
+	SpGistScanOpaque 		so = (SpGistScanOpaque) scan->opaque;
+	SpGistSearchItem		*item;
+
+	if (dir != ForwardScanDirection)
+		elog(ERROR, "SPGIST only supports forward scan direction");
+
+	if (so->keyIsNull)
+		PG_RETURN_BOOL(false);
+
+	if (!so->started)
+		spgStartSearch(scan);
+
+	while((item = spgGetNextSearchItem(so)) != NULL)
+	{
+		if (item->isHeapTuple)
+		{
+			scan->xs_ctup.t_self = item->heapPtr;
+			scan->xs_recheck = item->recheck;
+			pfree(item);
+			PG_RETURN_BOOL(true);
+		}
+
+		spgWalk(scan, item);
+		spgFreeSearchItem(item);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	PG_RETURN_BOOL(false);
+}
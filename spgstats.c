@@ -0,0 +1,347 @@
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/rel.h"
+#include "utils/tuplestore.h"
+
+#include "spgist.h"
+
+/*
+ * Statistics of SP-GiST usage, all backend-local: the functions below
+ * show what the calling session did, other sessions are not included and
+ * the totals are gone when the session ends.
+ *
+ * Traversal counters. Scans always count into their SpGistScanCounters,
+ * which costs a few additions per visited tuple. With spgist.track_stats
+ * on every scan is added at rescan and endscan to backend-local totals per
+ * index, shown by spg_scan_stats(), and logged at DEBUG1 level. The 9.1
+ * EXPLAIN can't print access method specific lines, so
+ *		SET client_min_messages = debug1;
+ *		EXPLAIN (ANALYZE, BUFFERS) ...
+ * shows them next to the plan.
+ */
+
+bool	spgist_track_stats = false;
+
+typedef struct SpGistIndexScanStats
+{
+	Oid					indexOid;
+	SpGistScanCounters	counters;
+} SpGistIndexScanStats;
+
+static HTAB *scanStatsHash = NULL;
+
+void		_PG_init(void);
+
+void
+_PG_init(void)
+{
+	spgRegisterReloptions();
+
+	DefineCustomBoolVariable("spgist.track_stats",
+							 "Collects traversal statistics of SP-GiST scans.",
+							 NULL,
+							 &spgist_track_stats,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("spgist.cache_levels",
+							"Number of upper levels of SP-GiST trees cached by each backend.",
+							NULL,
+							&spgist_cache_levels,
+							0,
+							0,
+							SPGIST_CACHE_MAX_LEVELS,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+}
+
+/*
+ * Entry for key in a backend-local stats hash, which is created on first
+ * use. Entries start with their key, the rest of a new entry is zeroed.
+ */
+void *
+spgStatsHashEntry(HTAB **hash, const char *name, Size keysize, Size entrysize,
+				  const void *key)
+{
+	char		*entry;
+	bool		found;
+
+	if (*hash == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = keysize;
+		ctl.entrysize = entrysize;
+		ctl.hash = (keysize == sizeof(Oid)) ? oid_hash : tag_hash;
+		*hash = hash_create(name, 16, &ctl, HASH_ELEM | HASH_FUNCTION);
+	}
+
+	entry = (char *) hash_search(*hash, key, HASH_ENTER, &found);
+	if (!found)
+		memset(entry + keysize, 0, entrysize - keysize);
+
+	return entry;
+}
+
+void
+spgReportScanCounters(Relation index, SpGistScanCounters *counters)
+{
+	SpGistIndexScanStats	*entry;
+	Oid						indexOid = RelationGetRelid(index);
+
+	if (counters->scans == 0)
+		return;
+
+	if (spgist_track_stats)
+	{
+		elog(DEBUG1, "spgist scan of \"%s\": "
+			 "%lld inner tuples, %lld nodes selected, %lld of %lld leaf tuples matched, "
+			 "%lld pages, depth %d",
+			 RelationGetRelationName(index),
+			 (long long) counters->innerTuples, (long long) counters->nodesSelected,
+			 (long long) counters->leafMatched, (long long) counters->leafTested,
+			 (long long) counters->pages, counters->maxDepth);
+
+		entry = (SpGistIndexScanStats*) spgStatsHashEntry(&scanStatsHash, "SP-GiST scan stats",
+														  sizeof(Oid), sizeof(SpGistIndexScanStats),
+														  &indexOid);
+
+		entry->counters.scans += counters->scans;
+		entry->counters.innerTuples += counters->innerTuples;
+		entry->counters.nodesSelected += counters->nodesSelected;
+		entry->counters.leafTested += counters->leafTested;
+		entry->counters.leafMatched += counters->leafMatched;
+		entry->counters.pages += counters->pages;
+		entry->counters.maxDepth = Max(entry->counters.maxDepth, counters->maxDepth);
+	}
+
+	memset(counters, 0, sizeof(*counters));
+}
+
+/*
+ * Result of a set returning function as a tuplestore filled at once, so
+ * no hash_seq_search stays open when the caller stops early, e.g. LIMIT
+ */
+static Tuplestorestate *
+beginMaterializedResult(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo		*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Tuplestorestate		*tupstore;
+	MemoryContext		oldCtx;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		elog(ERROR, "set-valued function called in context that cannot accept a set");
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldCtx = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = CreateTupleDescCopy(*tupdesc);
+	MemoryContextSwitchTo(oldCtx);
+
+	*tupdesc = rsinfo->setDesc;
+
+	return tupstore;
+}
+
+#define SPG_SCAN_STATS_NCOLUMNS	8
+
+PG_FUNCTION_INFO_V1(spg_scan_stats);
+Datum       spg_scan_stats(PG_FUNCTION_ARGS);
+Datum
+spg_scan_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc				tupdesc;
+	Tuplestorestate			*tupstore = beginMaterializedResult(fcinfo, &tupdesc);
+	HASH_SEQ_STATUS			status;
+	SpGistIndexScanStats	*entry;
+
+	if (scanStatsHash == NULL)
+		return (Datum) 0;
+
+	hash_seq_init(&status, scanStatsHash);
+	while((entry = (SpGistIndexScanStats*) hash_seq_search(&status)) != NULL)
+	{
+		Datum		values[SPG_SCAN_STATS_NCOLUMNS];
+		bool		nulls[SPG_SCAN_STATS_NCOLUMNS];
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = ObjectIdGetDatum(entry->indexOid);
+		values[1] = Int64GetDatum(entry->counters.scans);
+		values[2] = Int64GetDatum(entry->counters.innerTuples);
+		values[3] = Int64GetDatum(entry->counters.nodesSelected);
+		values[4] = Int64GetDatum(entry->counters.leafTested);
+		values[5] = Int64GetDatum(entry->counters.leafMatched);
+		values[6] = Int64GetDatum(entry->counters.pages);
+		values[7] = Int32GetDatum(entry->counters.maxDepth);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(spg_scan_stats_reset);
+Datum       spg_scan_stats_reset(PG_FUNCTION_ARGS);
+Datum
+spg_scan_stats_reset(PG_FUNCTION_ARGS)
+{
+	if (scanStatsHash)
+	{
+		hash_destroy(scanStatsHash);
+		scanStatsHash = NULL;
+	}
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Insert path events. Times go to histograms of power of two buckets in
+ * microseconds: [0,1), [1,2), [2,4), ...
+ */
+#define SPGIST_TIME_NBUCKETS	20
+
+typedef struct SpGistEventStats
+{
+	int64		count;
+	double		totalUs;
+	int64		hist[SPGIST_TIME_NBUCKETS];
+} SpGistEventStats;
+
+typedef struct SpGistIndexInsertStats
+{
+	Oid					indexOid;
+	SpGistEventStats	events[SPGIST_NEVENTS];
+} SpGistIndexInsertStats;
+
+static HTAB *insertStatsHash = NULL;
+
+static const char *eventNames[SPGIST_NEVENTS] = {
+	"insert",
+	"picksplit",
+	"add node",
+	"add node with move",
+	"split tuple",
+	"restart",
+	"new page from fsm",
+	"new page by extend"
+};
+
+void
+spgCountInsertEvent(Relation index, SpGistInsertEvent event, instr_time *start)
+{
+	SpGistIndexInsertStats	*entry;
+	SpGistEventStats		*es;
+	Oid						indexOid = RelationGetRelid(index);
+
+	entry = (SpGistIndexInsertStats*) spgStatsHashEntry(&insertStatsHash, "SP-GiST insert stats",
+														sizeof(Oid), sizeof(SpGistIndexInsertStats),
+														&indexOid);
+
+	es = entry->events + event;
+	es->count++;
+
+	if (start)
+	{
+		instr_time	duration;
+		double		us;
+		int			b = 0;
+
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, *start);
+		us = INSTR_TIME_GET_MICROSEC(duration);
+
+		es->totalUs += us;
+		while(us >= 1.0 && b < SPGIST_TIME_NBUCKETS - 1)
+		{
+			us /= 2.0;
+			b++;
+		}
+		es->hist[b]++;
+	}
+}
+
+#define SPG_INSERT_STATS_NCOLUMNS	5
+
+PG_FUNCTION_INFO_V1(spg_insert_stats);
+Datum       spg_insert_stats(PG_FUNCTION_ARGS);
+Datum
+spg_insert_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc				tupdesc;
+	Tuplestorestate			*tupstore = beginMaterializedResult(fcinfo, &tupdesc);
+	HASH_SEQ_STATUS			status;
+	SpGistIndexInsertStats	*entry;
+	int						event;
+
+	if (insertStatsHash == NULL)
+		return (Datum) 0;
+
+	hash_seq_init(&status, insertStatsHash);
+	while((entry = (SpGistIndexInsertStats*) hash_seq_search(&status)) != NULL)
+	{
+		for(event=0; event<SPGIST_NEVENTS; event++)
+		{
+			SpGistEventStats	*es = entry->events + event;
+			Datum				values[SPG_INSERT_STATS_NCOLUMNS];
+			bool				nulls[SPG_INSERT_STATS_NCOLUMNS];
+			Datum				elems[SPGIST_TIME_NBUCKETS];
+			int					n = SPGIST_TIME_NBUCKETS,
+								i;
+
+			if (es->count == 0)
+				continue;
+
+			memset(nulls, 0, sizeof(nulls));
+
+			while(n > 1 && es->hist[n - 1] == 0)
+				n--;
+			for(i=0; i<n; i++)
+				elems[i] = Int64GetDatum(es->hist[i]);
+
+			values[0] = ObjectIdGetDatum(entry->indexOid);
+			values[1] = CStringGetTextDatum(eventNames[event]);
+			values[2] = Int64GetDatum(es->count);
+			values[3] = Float8GetDatum(es->totalUs / 1000.0);
+			values[4] = PointerGetDatum(construct_array(elems, n, INT8OID,
+														sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(spg_insert_stats_reset);
+Datum       spg_insert_stats_reset(PG_FUNCTION_ARGS);
+Datum
+spg_insert_stats_reset(PG_FUNCTION_ARGS)
+{
+	if (insertStatsHash)
+	{
+		hash_destroy(insertStatsHash);
+		insertStatsHash = NULL;
+	}
+
+	PG_RETURN_VOID();
+}
@@ -1,9 +1,19 @@
 #include "postgres.h"
 
 #include "fmgr.h"
+#include "access/hash.h"
+#include "access/skey.h"
 #include "catalog/pg_type.h"
+#include "utils/memutils.h"
 #include "spgist.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* number of nodes picksplit deals a chain of equal values out to */
+#define SPG_TEXT_NSAMENODES		8
+
 PG_FUNCTION_INFO_V1(spg_text_config);
 Datum       spg_text_config(PG_FUNCTION_ARGS);
 Datum
@@ -17,21 +27,109 @@ spg_text_config(PG_FUNCTION_ARGS)
 	PG_RETURN_POINTER(cfg);
 }
 
+/*
+ * Returns length of common prefix of a and b. Keys like URLs share long
+ * prefixes, so compare by 16-byte vectors (SSE2) and machine words first
+ * and fall back to bytes only near the first difference.
+ */
 static int
 commonPrefix(char *a, char *b, int lena, int lenb)
 {
-	int i = 0;
+	int		n = Min(lena, lenb);
+	int 	i = 0;
 
-	while(i < lena && i < lenb && *a == *b)
+#ifdef __SSE2__
+	while(i + (int)sizeof(__m128i) <= n)
 	{
-		a++;
-		b++;
-		i++;
+		__m128i	va = _mm_loadu_si128((__m128i*)(a + i));
+		__m128i	vb = _mm_loadu_si128((__m128i*)(b + i));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff)
+			break;
+		i += sizeof(__m128i);
 	}
+#endif
+
+	while(i + (int)sizeof(uint64) <= n)
+	{
+		uint64	wa, wb;
+
+		memcpy(&wa, a + i, sizeof(wa));
+		memcpy(&wb, b + i, sizeof(wb));
+		if (wa != wb)
+			break;
+		i += sizeof(uint64);
+	}
+
+	while(i < n && a[i] == b[i])
+		i++;
 
 	return i;
 }
 
+/*
+ * Node labels of text_ops inner tuples are kept sorted as unsigned chars
+ * by picksplit and addNode, so lookup is a binary search. Labels near the
+ * root are often a dense run of bytes, so first probe the position the
+ * byte would have in such a run. Returns true if the label is found, *i
+ * is set to its node number or to the position for a new node otherwise.
+ */
+static bool
+searchChar(Datum *nodeDatums, int nNodes, uint8 c, int *i)
+{
+	int		lo = 0,
+			hi = nNodes;
+
+	if (nNodes > 0)
+	{
+		int	guess = (int)c - (int)(uint8)DatumGetChar(nodeDatums[0]);
+
+		if (guess >= 0 && guess < nNodes &&
+			(uint8)DatumGetChar(nodeDatums[guess]) == c)
+		{
+			*i = guess;
+			return true;
+		}
+	}
+
+	while(lo < hi)
+	{
+		int		mid = (lo + hi) / 2;
+		uint8	m = (uint8)DatumGetChar(nodeDatums[mid]);
+
+		if (m == c)
+		{
+			*i = mid;
+			return true;
+		}
+
+		if (m < c)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*i = lo;
+	return false;
+}
+
+/*
+ * Picksplit of a page whose tuples are all equal past the common prefix
+ * spreads them over several nodes with the same label (see below), so a
+ * label found by searchChar may be one of a run. Return bounds of the run.
+ */
+static void
+charRange(Datum *nodeDatums, int nNodes, int i, int *lo, int *hi)
+{
+	char	c = DatumGetChar(nodeDatums[i]);
+
+	*lo = *hi = i;
+	while(*lo > 0 && DatumGetChar(nodeDatums[*lo - 1]) == c)
+		(*lo)--;
+	while(*hi < nNodes - 1 && DatumGetChar(nodeDatums[*hi + 1]) == c)
+		(*hi)++;
+}
+
 PG_FUNCTION_INFO_V1(spg_text_choose);
 Datum       spg_text_choose(PG_FUNCTION_ARGS);
 Datum
@@ -110,34 +208,44 @@ spg_text_choose(PG_FUNCTION_ARGS)
 		nodeChar = '\0';
 	}
 
-	for(i=0; i<in->nNodes; i++)
+	if (searchChar(in->nodeDatums, in->nNodes, (uint8)nodeChar, &i))
 	{
-		if (DatumGetChar(in->nodeDatums[i]) == nodeChar)
+		int		lo, hi;
+
+		/*
+		 * spread values over all nodes of a run by their hash, so that the
+		 * same value always takes the same node and inserts are repeatable
+		 */
+		charRange(in->nodeDatums, in->nNodes, i, &lo, &hi);
+		if (hi > lo)
+			i = lo + DatumGetUInt32(hash_any((unsigned char *) VARDATA(inText), inSize)) %
+				(hi - lo + 1);
+
+		out->resultType = spgMatchNode;
+		out->result.matchNode.nodeN = i;
+		/* '\0' label marks end of value, it doesn't consume a byte */
+		out->result.matchNode.levelAdd = (nodeChar == '\0') ? common : common + 1;
+
+		if (nodeChar == '\0')
 		{
-			out->resultType = spgMatchNode;
-			out->result.matchNode.nodeN = i;
-			out->result.matchNode.levelAdd = common + 1;
-
-			if (nodeChar == '\0')
-			{
-				op = palloc(VARHDRSZ);
-				SET_VARSIZE(op, VARHDRSZ);
-			}
-			else
-			{
-				op = palloc(inSize + VARHDRSZ);
-				memmove(VARDATA(op), VARDATA(inText) + in->level + common + 1, 
-						inSize - in->level - common - 1);
-				SET_VARSIZE(op, VARHDRSZ + inSize - in->level - common - 1);
-			}
-
-			out->result.matchNode.restDatum = PointerGetDatum(op);
-			PG_RETURN_VOID();
+			op = palloc(VARHDRSZ);
+			SET_VARSIZE(op, VARHDRSZ);
 		}
+		else
+		{
+			op = palloc(inSize + VARHDRSZ);
+			memmove(VARDATA(op), VARDATA(inText) + in->level + common + 1, 
+					inSize - in->level - common - 1);
+			SET_VARSIZE(op, VARHDRSZ + inSize - in->level - common - 1);
+		}
+
+		out->result.matchNode.restDatum = PointerGetDatum(op);
+		PG_RETURN_VOID();
 	}
 
 	out->resultType = spgAddNode;
 	out->result.addNode.nodeDatum = CharGetDatum(nodeChar);
+	out->result.addNode.nodeN = i;
 
 	PG_RETURN_VOID();
 }
@@ -152,9 +260,12 @@ typedef struct nodePtr
 static int
 cmpNodePtr(const void *a, const void *b)
 {
-	if ( ((nodePtr*)a)->c == ((nodePtr*)b)->c )
+	uint8	ca = (uint8)((nodePtr*)a)->c,
+			cb = (uint8)((nodePtr*)b)->c;
+
+	if ( ca == cb )
 		return 0;
-	return ( ((nodePtr*)a)->c > ((nodePtr*)b)->c ) ? 1 : -1;
+	return ( ca > cb ) ? 1 : -1;
 }
 
 PG_FUNCTION_INFO_V1(spg_text_picksplit);
@@ -164,13 +275,16 @@ spg_text_picksplit(PG_FUNCTION_ARGS)
 {
 	spgPickSplitIn	*in = (spgPickSplitIn*)PG_GETARG_POINTER(0);
 	spgPickSplitOut	*out = (spgPickSplitOut*)PG_GETARG_POINTER(1);
-	int 			i, common = 0x7fffffff;
+	int 			i, common;
 	text			*op;
 	nodePtr			*nodes;
 
 	for(i=0; i<in->nTuples; i++)
 		in->datums[i] = PointerGetDatum(DatumGetTextP(in->datums[i]));
 
+	/* a single tuple is its own common prefix */
+	common = VARSIZE(in->datums[0]) - VARHDRSZ;
+
 	for(i=1; i<in->nTuples && common > 0; i++)
 	{
 		int tmp = commonPrefix(VARDATA(in->datums[0]),
@@ -237,32 +351,136 @@ spg_text_picksplit(PG_FUNCTION_ARGS)
 		out->mapTuplesToNodes[ nodes[i].i ] = out->nNodes - 1;
 	}
 
-	Assert(out->nNodes > 1);
+	/*
+	 * All tuples are equal past the common prefix, so there is the only
+	 * '\0' node. It would get all of the tuples back and the next insert
+	 * would split the same chain again, stacking single-node inner tuples
+	 * forever. Deal them out to several nodes with the same label instead.
+	 */
+	if (out->nNodes == 1)
+	{
+		out->nNodes = Min(in->nTuples, SPG_TEXT_NSAMENODES);
+		for(i=1; i<out->nNodes; i++)
+			out->nodeDatums[i] = out->nodeDatums[0];
+		for(i=0; i<in->nTuples; i++)
+			out->mapTuplesToNodes[i] = i % out->nNodes;
+	}
+
+	Assert(out->nNodes > 1 || in->nTuples == 1);
 
 	PG_RETURN_VOID();
 }
 
+/*
+ * Scans reconstruct the path from the root as traversal value: bytes of
+ * prefixes and labels ('\0' labels add nothing) of all inner tuples above.
+ * All values below a node start with its path, and a '\0' node holds only
+ * values equal to it. Comparisons are bytewise as in text_pattern_ops.
+ */
+#define SPG_TEXT_PREFIX_STRATEGY	6
+
+/*
+ * Compare concatenation of a and b with query on their common length,
+ * returns sign of memcmp
+ */
+static int
+cmpPathQuery(char *a, int lena, char *b, int lenb, char *q, int lenq)
+{
+	int		r = 0;
+
+	if (lena > 0 && lenq > 0)
+		r = memcmp(a, q, Min(lena, lenq));
+	if (r == 0 && lenq > lena && lenb > 0)
+		r = memcmp(b, q + lena, Min(lenb, lenq - lena));
+
+	return r;
+}
+
+/*
+ * Can a node whose path compares as r with query on their common length
+ * hold values satisfying the strategy? Exact means the node holds only
+ * the path itself.
+ */
+static bool
+pathConsistent(StrategyNumber strategy, int r, int lenpath, int lenq, bool exact)
+{
+	if (strategy == SPG_TEXT_PREFIX_STRATEGY)
+		return r == 0 && (!exact || lenpath >= lenq);
+
+	/*
+	 * Path equal to query on the common length: the node holds values
+	 * greater than query if path is longer. Otherwise an exact node
+	 * compares by length and others may hold values on both sides.
+	 */
+	if (r == 0 && (exact || lenpath > lenq))
+		r = (lenpath > lenq) ? 1 : ((lenpath < lenq) ? -1 : 0);
+
+	switch(strategy)
+	{
+		case BTLessStrategyNumber:
+			return r < 0 || (r == 0 && lenpath < lenq);
+		case BTLessEqualStrategyNumber:
+			return r <= 0;
+		case BTEqualStrategyNumber:
+			return r == 0;
+		case BTGreaterEqualStrategyNumber:
+			return r >= 0;
+		case BTGreaterStrategyNumber:
+			return r > 0 || (r == 0 && !exact);
+		default:
+			elog(ERROR, "unrecognized strategy number: %d", strategy);
+	}
+
+	return false;
+}
+
+#define PATHDATA(t)		( (t) ? VARDATA(t) : NULL )
+#define PATHSIZE(t)		( (t) ? VARSIZE(t) - VARHDRSZ : 0 )
+
 PG_FUNCTION_INFO_V1(spg_text_leaf_consistent);
 Datum       spg_text_leaf_consistent(PG_FUNCTION_ARGS);
 Datum
 spg_text_leaf_consistent(PG_FUNCTION_ARGS)
 {
-	int		level = PG_GETARG_INT32(0);
-	text	*query = PG_GETARG_TEXT_P(1);
-	text	*datum = PG_GETARG_TEXT_P(2);
-
-	if (VARSIZE(query) != VARSIZE(datum) + level)
-		PG_RETURN_BOOL(false);
-
-	if (VARSIZE(datum) == VARHDRSZ)
-		PG_RETURN_BOOL(true);
-
-	if (memcmp(VARDATA(datum), VARDATA(query) + level, VARSIZE(datum) - VARHDRSZ) == 0)
-		PG_RETURN_BOOL(true);
+	spgLeafConsistentIn		*in = (spgLeafConsistentIn*)PG_GETARG_POINTER(0);
+	spgLeafConsistentOut	*out = (spgLeafConsistentOut*)PG_GETARG_POINTER(1);
+	text	*path = (text*)in->traversalValue;
+	text	*datum = DatumGetTextPP(in->leafDatum);	/* short header on page */
+	int		lenpath = PATHSIZE(path),
+			lendatum = VARSIZE_ANY_EXHDR(datum);
+	bool	res = true;
+	int		i;
+
+	out->recheck = false;
+
+	for(i=0; res && i<in->nkeys; i++)
+	{
+		text	*query = DatumGetTextP(in->scankeys[i].sk_argument);
+		int		lenq = VARSIZE(query) - VARHDRSZ;
+		int		r;
+
+		/* fast path for equality: lengths must match */
+		if (in->scankeys[i].sk_strategy == BTEqualStrategyNumber &&
+			lenq != lenpath + lendatum)
+			PG_RETURN_BOOL(false);
+
+		r = cmpPathQuery(PATHDATA(path), lenpath, VARDATA_ANY(datum), lendatum,
+						 VARDATA(query), lenq);
+		res = pathConsistent(in->scankeys[i].sk_strategy, r,
+							 lenpath + lendatum, lenq, true);
+	}
 
-	PG_RETURN_BOOL(false);
+	PG_RETURN_BOOL(res);
 }
 
+/*
+ * Returns nodes whose paths are consistent with all keys. For equality
+ * and prefix keys the only candidate label is the query byte following
+ * the path, so the range of nodes to check is found by searchChar().
+ *
+ * Text scans rely on reconstructed paths only, so levelAdd is not
+ * meaningful when '\0' and other nodes are returned together.
+ */
 PG_FUNCTION_INFO_V1(spg_text_inner_consistent);
 Datum       spg_text_inner_consistent(PG_FUNCTION_ARGS);
 Datum
@@ -270,60 +488,122 @@ spg_text_inner_consistent(PG_FUNCTION_ARGS)
 {
 	spgInnerConsistentIn	*in = (spgInnerConsistentIn*)PG_GETARG_POINTER(0);
 	spgInnerConsistentOut	*out = (spgInnerConsistentOut*)PG_GETARG_POINTER(1);
-	text					*inText;
-	int						inSize;
-	int						common = 0, i;
-	char					nodeChar = '\0';
-
-	inText = DatumGetTextP(in->query);
-	inSize = VARSIZE(inText) - VARHDRSZ;
+	text					*path = (text*)in->traversalValue;
+	text					*prefixText = NULL;
+	int						lenpath = PATHSIZE(path),
+							prefixSize = 0,
+							lenbase;
+	int						*baseCmp;
+	int						lo = 0,
+							hi = in->nNodes - 1;
+	int						i, j;
+	MemoryContext			oldCtx;
 
 	if (in->hasPrefix)
 	{
-		text		*prefixText = DatumGetTextP(in->prefixDatum);
-		int			prefixSize = VARSIZE(prefixText) - VARHDRSZ;
+		prefixText = DatumGetTextP(in->prefixDatum);
+		prefixSize = VARSIZE(prefixText) - VARHDRSZ;
+	}
+	lenbase = lenpath + prefixSize;
 
-		common = commonPrefix(VARDATA(inText) + in->level,
-							  VARDATA(prefixText),
-							  inSize - in->level,
-							  prefixSize);
+	out->levelAdd = prefixSize + 1;
+	out->nodeNumbers = palloc(sizeof(int) * in->nNodes);
+	out->nNodes = 0;
 
-		if (common == prefixSize)
+	/* compare path and prefix with every query once */
+	baseCmp = palloc(sizeof(int) * (in->nkeys + 1));
+	for(j=0; j<in->nkeys; j++)
+	{
+		text	*query = DatumGetTextP(in->scankeys[j].sk_argument);
+		int		lenq = VARSIZE(query) - VARHDRSZ;
+		int		nlo, nhi;
+
+		baseCmp[j] = cmpPathQuery(PATHDATA(path), lenpath,
+								  PATHDATA(prefixText), prefixSize,
+								  VARDATA(query), lenq);
+
+		if (in->scankeys[j].sk_strategy != BTEqualStrategyNumber &&
+			in->scankeys[j].sk_strategy != SPG_TEXT_PREFIX_STRATEGY)
+			continue;
+
+		if (baseCmp[j] != 0)
+			PG_RETURN_VOID();
+		if (lenbase > lenq)
 		{
-			if (inSize - in->level > common)
-				nodeChar = *(VARDATA(inText) + in->level + common);
-			else
-				nodeChar = '\0';
+			/* query is a prefix of base: all nodes match prefix key */
+			if (in->scankeys[j].sk_strategy == BTEqualStrategyNumber)
+				PG_RETURN_VOID();
+			continue;
 		}
-		else
-		{
-			out->nNodes = 0;
+		if (lenbase == lenq && in->scankeys[j].sk_strategy == SPG_TEXT_PREFIX_STRATEGY)
+			continue;
+
+		if (!searchChar(in->nodeDatums, in->nNodes,
+						(lenbase == lenq) ? '\0' : (uint8)VARDATA(query)[lenbase], &i))
 			PG_RETURN_VOID();
-		}
+		charRange(in->nodeDatums, in->nNodes, i, &nlo, &nhi);
+		lo = Max(lo, nlo);
+		hi = Min(hi, nhi);
 	}
-	else if (inSize > in->level) 
-	{
-		nodeChar = *(VARDATA(inText) + in->level);
-	}
-	else
+
+	for(i=lo; i<=hi; i++)
 	{
-		nodeChar = '\0';
-	}
+		uint8	c = (uint8)DatumGetChar(in->nodeDatums[i]);
+		bool	res = true;
 
-	out->levelAdd = common + 1;
+		for(j=0; res && j<in->nkeys; j++)
+		{
+			text	*query = DatumGetTextP(in->scankeys[j].sk_argument);
+			int		lenq = VARSIZE(query) - VARHDRSZ;
+			int		r = baseCmp[j];
 
-	out->nodeNumbers = palloc(sizeof(int));
-	out->nNodes = 0;
+			if (r == 0 && c != '\0' && lenbase < lenq)
+				r = (c > (uint8)VARDATA(query)[lenbase]) ? 1 :
+					((c < (uint8)VARDATA(query)[lenbase]) ? -1 : 0);
 
-	for(i=0; i<in->nNodes; i++)
-		if ((inSize - in->level == 0 && DatumGetChar(in->nodeDatums[i]) == '\0') ||
-			*(VARDATA(inText) + in->level + common) == DatumGetChar(in->nodeDatums[i]))
-		{
-			out->nodeNumbers[0] = i;
-			out->nNodes++;
-			break;
+			res = pathConsistent(in->scankeys[j].sk_strategy, r,
+								 lenbase + (c != '\0'), lenq, c == '\0');
 		}
 
+		if (res)
+			out->nodeNumbers[out->nNodes++] = i;
+	}
+
+	if (out->nNodes == 0)
+		PG_RETURN_VOID();
+
+	oldCtx = MemoryContextSwitchTo(in->traversalMemoryContext);
+	out->traversalValues = palloc(sizeof(void*) * out->nNodes);
+	for(i=0; i<out->nNodes; i++)
+	{
+		char	c = DatumGetChar(in->nodeDatums[out->nodeNumbers[i]]);
+		int		len = lenbase + (c != '\0');
+		text	*t = palloc(VARHDRSZ + len);
+
+		if (lenpath > 0)
+			memcpy(VARDATA(t), VARDATA(path), lenpath);
+		if (prefixSize > 0)
+			memcpy(VARDATA(t) + lenpath, VARDATA(prefixText), prefixSize);
+		if (c != '\0')
+			VARDATA(t)[lenbase] = c;
+		SET_VARSIZE(t, VARHDRSZ + len);
+
+		out->traversalValues[i] = t;
+	}
+	MemoryContextSwitchTo(oldCtx);
+
 	PG_RETURN_VOID();
 }
 
+PG_FUNCTION_INFO_V1(spg_text_starts_with);
+Datum       spg_text_starts_with(PG_FUNCTION_ARGS);
+Datum
+spg_text_starts_with(PG_FUNCTION_ARGS)
+{
+	text	*t = PG_GETARG_TEXT_P(0);
+	text	*prefix = PG_GETARG_TEXT_P(1);
+	int		lent = VARSIZE(t) - VARHDRSZ,
+			lenp = VARSIZE(prefix) - VARHDRSZ;
+
+	PG_RETURN_BOOL(lenp <= lent && memcmp(VARDATA(t), VARDATA(prefix), lenp) == 0);
+}
@@ -8,8 +8,11 @@
 #include "storage/bufmgr.h"
 #include "storage/indexfsm.h"
 #include "utils/builtins.h"
+#include "utils/hsearch.h"
 #include "utils/memutils.h"
+#include "utils/snapmgr.h"
 #include "access/reloptions.h"
+#include "access/transam.h"
 #include "storage/freespace.h"
 #include "storage/indexfsm.h"
 #include "utils/lsyscache.h"
@@ -24,7 +27,10 @@ fillTypeDesc(SpGistTypeDesc *desc, Oid type)
 	desc->type = type;
 
 	if (type != InvalidOid)
+	{
 		get_typlenbyval(type, &desc->attlen, &desc->attbyval);
+		desc->attstorage = (desc->attlen == -1) ? get_typstorage(type) : 'p';
+	}
 }
 
 void
@@ -34,6 +40,10 @@ initSpGistState(SpGistState *state, Relation index)
 
 	Assert(index->rd_att->natts == 1);
 
+	if (!spgFormatIsCurrent(index))
+		elog(ERROR, "SP-GiST index \"%s\" has an old on-disk format, REINDEX required",
+			 RelationGetRelationName(index));
+
 	propOid = index_getprocid(index, 1, SPGIST_PROP_PROC);
 
 	state->prop = *(SpGistOpClassProp*)DatumGetPointer(OidFunctionCall0Coll(propOid, InvalidOid));
@@ -58,22 +68,84 @@ initSpGistState(SpGistState *state, Relation index)
 	state->nodeTupDesc = CreateTemplateTupleDesc(1, false);
 	TupleDescInitEntry(state->nodeTupDesc, (AttrNumber) 1, NULL,
 						state->attNodeType.type, -1, 0);
+
+	state->leafFreeSpace = 0;
+	state->innerFreeSpace = 0;
+	state->maxChainLength = SpGistGetOption(index, maxChainLength, 0);
+	state->bulkBuild = false;
+	state->needWAL = RelationNeedsWAL(index);
 }
 
 /*
- * Allocate a new page (either by recycling, or by extending the index file)
+ * Number of pages the relation is extended by at once, adapted to contention
+ * for the extension lock: doubled when the wait for it takes longer than
+ * SPGIST_EXTEND_WAIT_US, halved otherwise. Kept per backend, for all indexes.
+ */
+#define SPGIST_MAX_EXTEND_BATCH	64
+#define SPGIST_EXTEND_WAIT_US	100.0
+
+static int extendBatch = 1;
+
+/*
+ * Extra pages of the last batch, used by this backend before asking the
+ * FSM. Recording them in the FSM would need a vacuum of the whole FSM to
+ * make them visible, for every batch.
+ */
+static RelFileNode	extraNode;
+static BlockNumber	extraPages[SPGIST_MAX_EXTEND_BATCH];
+static int			nExtraPages = 0;
+
+/*
+ * Allocate a new page (either by recycling if useFSM, or by extending the
+ * index file)
  * The returned buffer is already pinned and exclusive-locked
  * Caller is responsible for initializing the page by calling SpGistInitBuffer
+ *
+ * Under contention the file is extended by extendBatch pages under one lock.
+ * The extra pages are left uninitialized and kept in the list above. Pages
+ * not used when the backend turns to another index or exits stay new, and
+ * vacuum records them in the FSM, so they are checked to be still new and
+ * still there before use.
  */
 		
 Buffer
-SpGistNewBuffer(Relation index)
+SpGistNewBuffer(Relation index, bool useFSM)
 {
 	Buffer      buffer;
 	bool        needLock;
+	instr_time	eventStart;
+	int			nExtend = 1;
+
+	SPGIST_EVENT_START(eventStart);
+
+	/* First, pages of our last batch */
+	if (nExtraPages > 0 && !RelFileNodeEquals(extraNode, index->rd_node))
+		nExtraPages = 0;
+	while (useFSM && nExtraPages > 0)
+	{
+		BlockNumber blkno = extraPages[--nExtraPages];
+
+		/* vacuum may have truncated it since our last transaction */
+		if (blkno >= RelationGetNumberOfBlocks(index))
+			continue;
+
+		buffer = ReadBuffer(index, blkno);
+		/* or recorded it in the FSM, for others to take */
+		if (ConditionalLockBuffer(buffer))
+		{
+			if (PageIsNew(BufferGetPage(buffer)))
+			{
+				SPGIST_EVENT_END(index, SPGIST_EV_NEWPAGE_EXTEND, eventStart);
+				return buffer;
+			}
+
+			LockBuffer(buffer, BUFFER_LOCK_UNLOCK);
+		}
+		ReleaseBuffer(buffer);
+	}
 				 
-	/* First, try to get a page from FSM */
-	for (;;)
+	/* Then, try to get a page from FSM */
+	while (useFSM)
 	{
 		BlockNumber blkno = GetFreeIndexPage(index);
 
@@ -89,11 +161,12 @@ SpGistNewBuffer(Relation index)
 		{
 			Page        page = BufferGetPage(buffer);
 
-			if (PageIsNew(page))
-				return buffer;  /* OK to use, if never initialized */
-
-			if (SpGistPageIsDeleted(page))
-				return buffer;  /* OK to use */
+			if (SpGistPageIsRecyclable(page))
+			{
+				/* OK to use, if never initialized or deleted long ago */
+				SPGIST_EVENT_END(index, SPGIST_EV_NEWPAGE_FSM, eventStart);
+				return buffer;
+			}
 
 			LockBuffer(buffer, BUFFER_LOCK_UNLOCK);
 		}
@@ -105,17 +178,68 @@ SpGistNewBuffer(Relation index)
 	/* Must extend the file */
 	needLock = !RELATION_IS_LOCAL(index);
 	if (needLock)
+	{
+		instr_time	waitStart,
+					wait;
+
+		INSTR_TIME_SET_CURRENT(waitStart);
 		LockRelationForExtension(index, ExclusiveLock);
+		INSTR_TIME_SET_CURRENT(wait);
+		INSTR_TIME_SUBTRACT(wait, waitStart);
+
+		if (INSTR_TIME_GET_MICROSEC(wait) > SPGIST_EXTEND_WAIT_US)
+			extendBatch = Min(extendBatch * 2, SPGIST_MAX_EXTEND_BATCH);
+		else
+			extendBatch = Max(extendBatch / 2, 1);
+
+		/* build doesn't look for free pages, nor compete for the lock */
+		if (useFSM)
+			nExtend = extendBatch;
+	}
 
 	buffer = ReadBuffer(index, P_NEW);
 	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
 
+	if (nExtend > 1)
+	{
+		int		i;
+
+		/* pages left from a batch of another index are new for its vacuum */
+		extraNode = index->rd_node;
+		nExtraPages = nExtend - 1;
+		for(i=1; i<nExtend; i++)
+		{
+			Buffer	extra = ReadBuffer(index, P_NEW);
+
+			/* taken from the end, lowest block first */
+			extraPages[nExtend - 1 - i] = BufferGetBlockNumber(extra);
+			ReleaseBuffer(extra);
+		}
+	}
+
 	if (needLock)
 		UnlockRelationForExtension(index, ExclusiveLock);
 
+	SPGIST_EVENT_END(index, SPGIST_EV_NEWPAGE_EXTEND, eventStart);
+
 	return buffer;
 }
 
+/*
+ * Page deleted by picksplit keeps its tuples for scans which queued its
+ * chain before, it can be reused once all transactions running at that
+ * time are gone, like in B-tree.
+ */
+bool
+SpGistPageIsRecyclable(Page page)
+{
+	if (PageIsNew(page))
+		return true;
+
+	return SpGistPageIsDeleted(page) &&
+		TransactionIdPrecedes(SpGistPageGetOpaque(page)->deleteXid, RecentGlobalXmin);
+}
+
 void
 SpGistInitBuffer(Buffer b, uint16 f)
 {
@@ -130,6 +254,7 @@ SpGistInitPage(Page page, uint16 f, Size pageSize)
 	opaque = SpGistPageGetOpaque(page);
 	memset(opaque, 0, sizeof(SpGistPageOpaqueData));
 	opaque->flags = f;
+	opaque->nextBlkno = InvalidBlockNumber;
 }
 
 void
@@ -143,6 +268,31 @@ SpGistInitMetabuffer(Buffer b, Relation index)
 	metadata->magickNumber = SPGIST_MAGICK_NUMBER;
 }
 
+static relopt_kind spgistReloptKind;
+
+/*
+ * Called from _PG_init(), see SpGistOptions
+ */
+void
+spgRegisterReloptions(void)
+{
+	spgistReloptKind = add_reloption_kind();
+
+	add_int_reloption(spgistReloptKind, "fillfactor",
+					  "Packs leaf pages of the index built to this percentage",
+					  SPGIST_DEFAULT_FILLFACTOR, SPGIST_MIN_FILLFACTOR, 100);
+	add_int_reloption(spgistReloptKind, "inner_fillfactor",
+					  "Packs inner pages of the index built to this percentage",
+					  SPGIST_DEFAULT_FILLFACTOR, SPGIST_MIN_FILLFACTOR, 100);
+	/* 1 is rejected by spgoptions, a chain of one tuple can't be split */
+	add_int_reloption(spgistReloptKind, "max_chain_length",
+					  "Splits leaf chains of this many tuples, 0 for no limit",
+					  0, 0, MaxIndexTuplesPerPage);
+	add_bool_reloption(spgistReloptKind, "bulk_build",
+					   "Builds the index without looking for free pages",
+					   true);
+}
+
 PG_FUNCTION_INFO_V1(spgoptions);
 Datum       spgoptions(PG_FUNCTION_ARGS);
 Datum
@@ -152,11 +302,29 @@ spgoptions(PG_FUNCTION_ARGS)
 	bool        validate = PG_GETARG_BOOL(1);
 	bytea      *result;
 
-	result = default_reloptions(reloptions, validate, RELOPT_KIND_GIST);
+	relopt_value *options;
+	int			numoptions;
+	static const relopt_parse_elt tab[] = {
+		{"fillfactor", RELOPT_TYPE_INT, offsetof(SpGistOptions, leafFillfactor)},
+		{"inner_fillfactor", RELOPT_TYPE_INT, offsetof(SpGistOptions, innerFillfactor)},
+		{"max_chain_length", RELOPT_TYPE_INT, offsetof(SpGistOptions, maxChainLength)},
+		{"bulk_build", RELOPT_TYPE_BOOL, offsetof(SpGistOptions, bulkBuild)}
+	};
 
-	if (result)
-		PG_RETURN_BYTEA_P(result);
-	PG_RETURN_NULL();
+	options = parseRelOptions(reloptions, validate, spgistReloptKind, &numoptions);
+
+	if (numoptions == 0)
+		PG_RETURN_NULL();
+
+	result = allocateReloptStruct(sizeof(SpGistOptions), options, numoptions);
+	fillRelOptions((void *) result, sizeof(SpGistOptions), options, numoptions,
+				   validate, tab, lengthof(tab));
+	pfree(options);
+
+	if (validate && ((SpGistOptions *) result)->maxChainLength == 1)
+		elog(ERROR, "value 1 out of bounds for option \"max_chain_length\", it must be 0 or at least 2");
+
+	PG_RETURN_BYTEA_P(result);
 }
 
 unsigned int
@@ -194,20 +362,44 @@ memcpyDatum(void *in, SpGistTypeDesc *att, Datum datum)
 	return MAXALIGN(size);
 }
 
+/*
+ * Form a leaf tuple in the compact layout described in spgist.h, its size
+ * is SGLTSIZE
+ */
 SpGistLeafTuple
 spgFormLeafTuple(SpGistState *state, ItemPointer heapPtr, Datum datum)
 {
+	SpGistTypeDesc	*att = &state->attType;
 	SpGistLeafTuple	tup;
-	unsigned int	size = SGLTHDRSZ + getTypeLength(&state->attType, datum);
+	Pointer			val = DatumGetPointer(datum);
+	Size			dataSize;
+	bool			makeShort = false;
 
-	Assert(size < 0xffff);
-	tup = palloc0(size);
+	if (att->attlen > 0)
+		dataSize = att->attlen;
+	else if (att->attstorage != 'p' && VARATT_CAN_MAKE_SHORT(val))
+	{
+		dataSize = VARATT_CONVERTED_SHORT_SIZE(val);
+		makeShort = true;
+	}
+	else
+		dataSize = VARSIZE_ANY(val);
+
+	Assert(SGLTHDRSZ + dataSize < 0xffff);
+	tup = palloc0(SGLTHDRSZ + dataSize);
 
 	tup->heapPtr = *heapPtr;
 	tup->nextOffset = InvalidOffsetNumber;
-	tup->size = size;
 
-	memcpyDatum(SGLTDATAPTR(tup), &state->attType, datum);
+	if (att->attbyval)
+		store_att_byval(SGLTDATAPTR(tup), datum, att->attlen);
+	else if (makeShort)
+	{
+		SET_VARSIZE_SHORT(SGLTDATAPTR(tup), dataSize);
+		memcpy(SGLTDATAPTR(tup) + VARHDRSZ_SHORT, VARDATA(val), dataSize - VARHDRSZ_SHORT);
+	}
+	else
+		memcpy(SGLTDATAPTR(tup), val, dataSize);
 
 	return tup;
 }
@@ -251,6 +443,273 @@ spgFormInnerTuple(SpGistState *state, bool hasPrefix, Datum prefix, int nNodes,
 	return tup;
 }
 
+/*
+ * Number of inner tuples on the longest path from given inner tuple down to
+ * a leaf chain. Child links are copied out and the page is released before
+ * descending, so only one page is pinned at a time.
+ */
+static int
+spgStatDepth(Relation index, SpGistState *state, BlockNumber blkno, OffsetNumber offset)
+{
+	Buffer				buffer;
+	Page				page;
+	SpGistInnerTuple	innerTuple;
+	IndexTuple			node;
+	ItemPointerData		*children;
+	int					nChildren = 0,
+						depth = 0,
+						i;
+
+	buffer = ReadBuffer(index, blkno);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buffer);
+
+	if (SpGistPageIsLeaf(page))
+	{
+		UnlockReleaseBuffer(buffer);
+		return 0;
+	}
+
+	innerTuple = (SpGistInnerTuple) PageGetItem(page, PageGetItemId(page, offset));
+
+	if (SGITISREDIRECT(innerTuple))
+	{
+		ItemPointerData	target = *SGITREDIRECT(innerTuple);
+
+		UnlockReleaseBuffer(buffer);
+		return spgStatDepth(index, state,
+							ItemPointerGetBlockNumber(&target),
+							ItemPointerGetOffsetNumber(&target));
+	}
+
+	children = palloc(sizeof(ItemPointerData) * innerTuple->nNodes);
+	SGITITERATE(innerTuple, state, i, node)
+	{
+		if (ItemPointerIsValid(&node->t_tid))
+			children[nChildren++] = node->t_tid;
+	}
+
+	UnlockReleaseBuffer(buffer);
+
+	for(i=0; i<nChildren; i++)
+	{
+		int		d = spgStatDepth(index, state,
+								 ItemPointerGetBlockNumber(children + i),
+								 ItemPointerGetOffsetNumber(children + i));
+
+		depth = Max(depth, d);
+	}
+
+	pfree(children);
+
+	return depth + 1;
+}
+
+/*
+ * Full pass over the index collecting its shape. Every leaf tuple except
+ * chain heads is pointed to by nextOffset of another one on the same page,
+ * so chains are counted without following node links.
+ */
+void
+spgComputeStats(Relation index, SpGistState *state, BufferAccessStrategy strategy,
+				SpGistStats *stats)
+{
+	BlockNumber	blkno,
+				npages;
+
+	memset(stats, 0, sizeof(*stats));
+
+	npages = RelationGetNumberOfBlocks(index);
+
+	for(blkno=SPGIST_HEAD_BLKNO; blkno<npages; blkno++)
+	{
+		Buffer			buffer;
+		Page			page;
+		OffsetNumber	i,
+						maxoff;
+
+		buffer = ReadBufferExtended(index, MAIN_FORKNUM, blkno,
+									RBM_NORMAL, strategy);
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buffer);
+
+		/* the NULLs list is not a part of the tree's shape */
+		if (PageIsNew(page) || SpGistPageIsDeleted(page) || SpGistPageIsNulls(page))
+		{
+			UnlockReleaseBuffer(buffer);
+			continue;
+		}
+
+		maxoff = SpGistPageGetMaxOffset(page);
+
+		if (SpGistPageIsLeaf(page))
+		{
+			stats->nLeafPages++;
+			stats->nLeafTuples += maxoff;
+			stats->nChains += maxoff;
+
+			for(i=FirstOffsetNumber; i<=maxoff; i++)
+				if (((SpGistLeafTuple) PageGetItem(page, PageGetItemId(page, i)))->nextOffset !=
+						InvalidOffsetNumber)
+					stats->nChains--;
+		}
+		else
+		{
+			stats->nInnerPages++;
+			stats->nInnerTuples += maxoff;
+
+			for(i=FirstOffsetNumber; i<=maxoff; i++)
+				stats->nNodes += ((SpGistInnerTuple) PageGetItem(page, PageGetItemId(page, i)))->nNodes;
+		}
+
+		UnlockReleaseBuffer(buffer);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	stats->maxDepth = spgStatDepth(index, state, SPGIST_HEAD_BLKNO, FirstOffsetNumber);
+}
+
+void
+spgGetStats(Relation index, SpGistStats *stats)
+{
+	Buffer				buffer;
+	SpGistMetaPageData	*metaData;
+
+	buffer = ReadBuffer(index, SPGIST_METAPAGE_BLKNO);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	metaData = SpGistPageGetMeta(BufferGetPage(buffer));
+	if (metaData->magickNumber != SPGIST_MAGICK_NUMBER)
+	{
+		UnlockReleaseBuffer(buffer);
+		elog(ERROR, "SP-GiST index \"%s\" has an old on-disk format, REINDEX required",
+			 RelationGetRelationName(index));
+	}
+	*stats = metaData->stats;
+	UnlockReleaseBuffer(buffer);
+}
+
+/*
+ * Was the index built by this version of the on-disk format? Doesn't fail,
+ * so the planner can still plan queries on a table with an old index.
+ */
+bool
+spgFormatIsCurrent(Relation index)
+{
+	Buffer	buffer;
+	bool	current;
+
+	buffer = ReadBuffer(index, SPGIST_METAPAGE_BLKNO);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	current = (SpGistPageGetMeta(BufferGetPage(buffer))->magickNumber == SPGIST_MAGICK_NUMBER);
+	UnlockReleaseBuffer(buffer);
+
+	return current;
+}
+
+/*
+ * Backend-local changes of metapage stats not written yet, by relfilenode
+ * as the batch of new pages, so REINDEX or TRUNCATE start from scratch
+ */
+typedef struct SpGistPendingStats
+{
+	RelFileNode	node;
+	int			nInserts;
+	SpGistStats	delta;		/* maxDepth is a maximum, not a delta */
+} SpGistPendingStats;
+
+static HTAB *pendingStatsHash = NULL;
+
+static SpGistPendingStats *
+getPendingStats(Relation index)
+{
+	return (SpGistPendingStats*) spgStatsHashEntry(&pendingStatsHash, "SP-GiST pending stats",
+												   sizeof(RelFileNode), sizeof(SpGistPendingStats),
+												   &index->rd_node);
+}
+
+void
+spgUpdateStats(Relation index, SpGistStats *stats)
+{
+	Buffer				buffer;
+	SpGistMetaPageData	*metaData;
+	SpGistPendingStats	*pending = getPendingStats(index);
+
+	buffer = ReadBuffer(index, SPGIST_METAPAGE_BLKNO);
+	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+	metaData = SpGistPageGetMeta(BufferGetPage(buffer));
+
+	START_CRIT_SECTION();
+	metaData->stats = *stats;
+	MarkBufferDirty(buffer);
+	END_CRIT_SECTION();
+
+	UnlockReleaseBuffer(buffer);
+
+	/* exact values include everything this backend has done so far */
+	pending->nInserts = 0;
+	memset(&pending->delta, 0, sizeof(pending->delta));
+}
+
+/*
+ * Adds changes counted by spgdoinsert() to the pending ones and zeroes
+ * them. Called after the critical section making the changes, so an
+ * ERROR before it leaves the counters alone.
+ */
+void
+spgAddPendingStats(Relation index, SpGistStats *change)
+{
+	SpGistStats	*delta = &getPendingStats(index)->delta;
+
+	delta->nInnerPages += change->nInnerPages;
+	delta->nLeafPages += change->nLeafPages;
+	delta->nInnerTuples += change->nInnerTuples;
+	delta->nNodes += change->nNodes;
+	delta->nLeafTuples += change->nLeafTuples;
+	delta->nChains += change->nChains;
+	delta->nSplits += change->nSplits;
+	delta->maxDepth = Max(delta->maxDepth, change->maxDepth);
+
+	memset(change, 0, sizeof(*change));
+}
+
+/*
+ * Called once per inserted tuple, adds pending changes to the metapage
+ * every SPGIST_STATS_FLUSH calls. Counters are only hints for the planner
+ * and monitoring, so the change is not WAL-logged.
+ */
+void
+spgFlushPendingStats(Relation index)
+{
+	SpGistPendingStats	*pending = getPendingStats(index);
+	SpGistStats			*delta = &pending->delta;
+	SpGistStats			*stats;
+	Buffer				buffer;
+
+	if (++pending->nInserts < SPGIST_STATS_FLUSH)
+		return;
+
+	buffer = ReadBuffer(index, SPGIST_METAPAGE_BLKNO);
+	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+	stats = &SpGistPageGetMeta(BufferGetPage(buffer))->stats;
+
+	START_CRIT_SECTION();
+	stats->nInnerPages += delta->nInnerPages;
+	stats->nLeafPages += delta->nLeafPages;
+	stats->nInnerTuples += delta->nInnerTuples;
+	stats->nNodes += delta->nNodes;
+	stats->nLeafTuples += delta->nLeafTuples;
+	stats->nChains += delta->nChains;
+	stats->nSplits += delta->nSplits;
+	stats->maxDepth = Max(stats->maxDepth, delta->maxDepth);
+	MarkBufferDirty(buffer);
+	END_CRIT_SECTION();
+
+	UnlockReleaseBuffer(buffer);
+
+	pending->nInserts = 0;
+	memset(delta, 0, sizeof(*delta));
+}
+
 PG_FUNCTION_INFO_V1(spgstat);
 Datum       spgstat(PG_FUNCTION_ARGS);
 Datum
@@ -270,7 +729,10 @@ spgstat(PG_FUNCTION_ARGS)
 	char		res[1024];
 	int			bufferSize = -1;
 	int64		innerTuples = 0,
-				leafTuples = 0;
+				leafTuples = 0,
+				nodes = 0;
+	int			maxDepth;
+	SpGistState	state;
 
 
 	relname_list = stringToQualifiedNameList(relname);
@@ -294,14 +756,27 @@ spgstat(PG_FUNCTION_ARGS)
 
 		page = BufferGetPage(buffer);
 
-		if (SpGistPageIsLeaf(page))
+		/* extended ahead by SpGistNewBuffer and not used yet, or split */
+		if (PageIsNew(page) || SpGistPageIsDeleted(page))
+		{
+			emptyPages++;
+			UnlockReleaseBuffer(buffer);
+			continue;
+		}
+
+		if (SpGistPageIsLeaf(page) || SpGistPageIsNulls(page))
 		{
 			leafTuples += SpGistPageGetMaxOffset(page);
 		}
 		else
 		{
+			OffsetNumber	i;
+
 			innerPages++;
 			innerTuples += SpGistPageGetMaxOffset(page);
+
+			for(i=FirstOffsetNumber; i<=SpGistPageGetMaxOffset(page); i++)
+				nodes += ((SpGistInnerTuple) PageGetItem(page, PageGetItemId(page, i)))->nNodes;
 		}
 
 		if (bufferSize < 0)
@@ -316,6 +791,9 @@ spgstat(PG_FUNCTION_ARGS)
 		UnlockReleaseBuffer(buffer);
 	}
 
+	initSpGistState(&state, index);
+	maxDepth = spgStatDepth(index, &state, SPGIST_HEAD_BLKNO, FirstOffsetNumber);
+
 	index_close(index, AccessExclusiveLock);
 
 	totalPages--; /* metapage */
@@ -329,15 +807,68 @@ spgstat(PG_FUNCTION_ARGS)
 		"freeSpace:   %.2f kbytes\n"
 		"fillRatio:   %.2f%c\n"
 		"leafTuples:  %lld\n"
-		"innerTuples: %lld",
+		"innerTuples: %lld\n"
+		"avgFanout:   %.2f\n"
+		"maxDepth:    %d",
 			totalPages, innerPages, totalPages - innerPages, emptyPages,
 			usedSpace / 1024.0,
 			(( (double) bufferSize ) * ( (double) totalPages ) - usedSpace) / 1024,
 			100.0 * ( usedSpace / (( (double) bufferSize ) * ( (double) totalPages )) ),
 			'%',
-			leafTuples, innerTuples
+			leafTuples, innerTuples,
+			(innerTuples > 0) ? ((double) nodes) / ((double) innerTuples) : 0.0,
+			maxDepth
 	);
 
 	PG_RETURN_TEXT_P(CStringGetTextDatum(res));
 }
 
+
+/*
+ * Counters kept in the metapage, cheap enough to call on a live index
+ */
+PG_FUNCTION_INFO_V1(spgmetastat);
+Datum       spgmetastat(PG_FUNCTION_ARGS);
+Datum
+spgmetastat(PG_FUNCTION_ARGS)
+{
+    text    	*name=PG_GETARG_TEXT_P(0);
+	char 		*relname=text_to_cstring(name);
+	RangeVar   	*relvar;
+	Relation    index;
+	Oid			relOid;
+	SpGistStats	stats;
+	char		res[1024];
+
+	relvar = makeRangeVarFromNameList(stringToQualifiedNameList(relname));
+	relOid = RangeVarGetRelid(relvar, false);
+	index = index_open(relOid, AccessShareLock);
+
+	if ( index->rd_am == NULL )
+		elog(ERROR, "Relation %s.%s is not an index",
+					get_namespace_name(RelationGetNamespace(index)),
+					RelationGetRelationName(index) );
+
+	spgGetStats(index, &stats);
+
+	index_close(index, AccessShareLock);
+
+	snprintf(res, sizeof(res),
+		"innerPages:  %u\n"
+		"leafPages:   %u\n"
+		"leafTuples:  %lld\n"
+		"innerTuples: %lld\n"
+		"avgFanout:   %.2f\n"
+		"avgChain:    %.2f\n"
+		"maxDepth:    %u\n"
+		"splits:      %lld",
+			stats.nInnerPages, stats.nLeafPages,
+			(long long) stats.nLeafTuples, (long long) stats.nInnerTuples,
+			(stats.nInnerTuples > 0) ? ((double) stats.nNodes) / ((double) stats.nInnerTuples) : 0.0,
+			(stats.nChains > 0) ? ((double) stats.nLeafTuples) / ((double) stats.nChains) : 0.0,
+			stats.maxDepth,
+			(long long) stats.nSplits
+	);
+
+	PG_RETURN_TEXT_P(CStringGetTextDatum(res));
+}
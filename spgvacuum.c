@@ -140,6 +140,9 @@ spgvacuumcleanup(PG_FUNCTION_ARGS)
 	BlockNumber totFreePages;
 	BlockNumber lastBlock = SPGIST_HEAD_BLKNO,
 				lastFilledBlock = SPGIST_HEAD_BLKNO;
+	SpGistState	state;
+	SpGistStats	spgStats,
+				oldStats;
 
 	if (info->analyze_only)
 		PG_RETURN_POINTER(stats);
@@ -168,11 +171,17 @@ spgvacuumcleanup(PG_FUNCTION_ARGS)
 		LockBuffer(buffer, BUFFER_LOCK_SHARE);
 		page = (Page) BufferGetPage(buffer);
 																						
-		if (SpGistPageIsDeleted(page))
+		/* new pages are left by batch extension in SpGistNewBuffer */
+		if (SpGistPageIsRecyclable(page))
 		{
 			RecordFreeIndexPage(index, blkno);
 			totFreePages++;
 		}
+		else if (SpGistPageIsDeleted(page))
+		{
+			/* may still be read by scans, reused by a later vacuum */
+			lastFilledBlock = blkno;
+		}
 		else
 		{
 			lastFilledBlock = blkno;
@@ -183,17 +192,52 @@ spgvacuumcleanup(PG_FUNCTION_ARGS)
 		UnlockReleaseBuffer(buffer);
 	}
 
+	/*
+	 * Free pages at the end are cut off like heap vacuum does: only if no
+	 * insert or scan holds a lock on the index, and after checking them
+	 * again, an insert may have taken one from the FSM or its batch since
+	 * we looked.
+	 */
 	lastBlock = npages - 1;
-	if (lastBlock > lastFilledBlock)
+	if (lastBlock > lastFilledBlock &&
+		ConditionalLockRelation(index, AccessExclusiveLock))
 	{
-		RelationTruncate(index, lastFilledBlock + 1);
-		stats->pages_removed = lastBlock - lastFilledBlock;
-		totFreePages = totFreePages - stats->pages_removed;
+		npages = RelationGetNumberOfBlocks(index);
+
+		for(blkno = npages; blkno > lastFilledBlock + 1; blkno--)
+		{
+			Buffer		buffer;
+			bool		recyclable;
+
+			buffer = ReadBufferExtended(index, MAIN_FORKNUM, blkno - 1,
+										RBM_NORMAL, info->strategy);
+			LockBuffer(buffer, BUFFER_LOCK_SHARE);
+			recyclable = SpGistPageIsRecyclable(BufferGetPage(buffer));
+			UnlockReleaseBuffer(buffer);
+
+			if (!recyclable)
+				break;
+		}
+
+		if (blkno < npages)
+		{
+			RelationTruncate(index, blkno);
+			stats->pages_removed = npages - blkno;
+			totFreePages = totFreePages - Min(stats->pages_removed, totFreePages);
+		}
+
+		UnlockRelation(index, AccessExclusiveLock);
 	}
 
 	IndexFreeSpaceMapVacuum(info->index);
 	stats->pages_free = totFreePages;
 
+	initSpGistState(&state, index);
+	spgGetStats(index, &oldStats);
+	spgComputeStats(index, &state, info->strategy, &spgStats);
+	spgStats.nSplits = oldStats.nSplits;
+	spgUpdateStats(index, &spgStats);
+
 	if (needLock)
 		LockRelationForExtension(index, ExclusiveLock);
 	stats->num_pages = RelationGetNumberOfBlocks(index);
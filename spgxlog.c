@@ -0,0 +1,77 @@
+#include "postgres.h"
+
+#include "access/heapam.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/rel.h"
+
+#include "spgist.h"
+
+/*
+ * WAL logging of SP-GiST pages.
+ *
+ * 9.1 has no way for an extension to add a resource manager, so changes
+ * can't be logged as SP-GiST specific records replayed by our own redo.
+ * Every changed page is logged as a full image by log_newpage(), which is
+ * replayed by the heap resource manager on recovery and standbys.
+ *
+ * To keep the volume down the common case changes one page: a leaf tuple
+ * is linked after the head of its chain, so the parent inner tuple is left
+ * alone. Operations changing several pages (picksplit, addNode with move,
+ * splitTuple) are ordered so that every prefix of their records is a
+ * consistent tree: new pages are written while unreachable, one write of
+ * the parent switches to them, and the old copy is retired last. New pages
+ * are taken before the first change, and each change with its record is
+ * done in a critical section, so an error can't leave a page half done.
+ *
+ * Build doesn't log while it runs: it logs every page once at the end, by
+ * spgLogIndex(). Metapage statistics are hints and are not logged, the
+ * metapage is logged only with upperVersion changes, so caches of standby
+ * backends notice changes of the upper levels.
+ */
+
+/*
+ * Log the image of a changed page. Caller holds it exclusively locked and
+ * has marked it dirty.
+ */
+void
+spgLogPage(Relation index, SpGistState *state, Buffer buffer)
+{
+	if (!state->needWAL)
+		return;
+
+	log_newpage(&index->rd_node, MAIN_FORKNUM,
+				BufferGetBlockNumber(buffer), BufferGetPage(buffer));
+}
+
+/*
+ * Log every initialized page of the index, called at the end of build
+ */
+void
+spgLogIndex(Relation index)
+{
+	BlockNumber		blkno,
+					npages;
+
+	if (!RelationNeedsWAL(index))
+		return;
+
+	npages = RelationGetNumberOfBlocks(index);
+
+	for(blkno=SPGIST_METAPAGE_BLKNO; blkno<npages; blkno++)
+	{
+		Buffer	buffer = ReadBuffer(index, blkno);
+
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+
+		/* pages added by extension in advance are left for the FSM */
+		if (!PageIsNew(BufferGetPage(buffer)))
+		{
+			MarkBufferDirty(buffer);
+			log_newpage(&index->rd_node, MAIN_FORKNUM, blkno, BufferGetPage(buffer));
+		}
+
+		UnlockReleaseBuffer(buffer);
+		CHECK_FOR_INTERRUPTS();
+	}
+}
@@ -7,6 +7,7 @@ CREATE TABLE test_text(t text);
 CREATE INDEX ttidx ON test_text USING spgist (t);
 
 SET enable_seqscan=off;
+SET enable_indexscan=off;
 
 EXPLAIN (COSTS OFF)
 SELECT * FROM test_text WHERE t = 'http://0-2000webhosting.co.uk/email-configuration.htm';
@@ -25,6 +26,33 @@ SELECT * FROM test_text WHERE t = 'http://www.skiing-holidays-austria.co.uk/16/p
 
 SELECT * FROM test_text WHERE t = 'http://www.all-inclusive-holiday-bargains.co.uk/all-inclusive-holidays-austria.htm';
 
+INSERT INTO test_text SELECT 'http://www.data-wales.co.uk/lamb.htm' FROM generate_series(1, 500);
+
+SELECT count(*) FROM test_text WHERE t = 'http://www.data-wales.co.uk/lamb.htm';
+
+EXPLAIN (COSTS OFF)
+SELECT count(*) FROM test_text WHERE t ^@ 'http://www.a';
+
+SELECT count(*) FROM test_text WHERE t ^@ 'http://www.a';
+
+SELECT count(*) FROM test_text WHERE t ^@ 'http://www.data-wales.co.uk/lamb.htm';
+
+SELECT count(*) FROM test_text WHERE t ~<~ 'http://b';
+
+SELECT count(*) FROM test_text WHERE t ~<=~ 'http://www.data-wales.co.uk/lamb.htm';
+
+SELECT count(*) FROM test_text WHERE t ~>=~ 'http://www.data-wales.co.uk/lamb.htm';
+
+SELECT count(*) FROM test_text WHERE t ~>~ 'http://www.s';
+
+SELECT count(*) FROM test_text WHERE t ~>=~ 'http://www.a' AND t ~<~ 'http://www.c';
+
+SELECT count(*) FROM test_text WHERE t ^@ 'http://www.' AND t ~<=~ 'http://www.b';
+
+SELECT count(*) FROM test_text WHERE t = ANY(ARRAY['http://www.data-wales.co.uk/lamb.htm', 'http://www.airportparkingexpress.co.uk/belfast.htm', 'http://abcde.co.uk/betterhearingservices/about_us.html', 'http://nonexistent/']);
+
+SELECT count(*) FROM test_text WHERE t = ANY(ARRAY['http://www.data-wales.co.uk/lamb.htm', NULL]);
+
 
 CREATE TABLE test_quad(p point);
 
@@ -38,3 +66,216 @@ SELECT * FROM test_quad WHERE p ~= '(8.51277472174491,5.86434731598175)';
 SELECT * FROM test_quad WHERE p ~= '(8.51277472174491,5.86434731598175)';
 
 SELECT * FROM test_quad WHERE p ~= '(1.39955907884019,9.12045046572942)';
+
+SELECT count(*) FROM test_quad WHERE p ~= ANY(ARRAY['(8.51277472174491,5.86434731598175)'::point, NULL]);
+
+SELECT count(*) FROM test_quad WHERE p <@ box '(2,3),(6,8)';
+
+SELECT count(*) FROM test_quad WHERE p << '(5.0,5.0)';
+
+SELECT count(*) FROM test_quad WHERE p >> '(5.0,5.0)';
+
+SELECT count(*) FROM test_quad WHERE p <^ '(5.0,5.0)';
+
+SELECT count(*) FROM test_quad WHERE p >^ '(5.0,5.0)';
+
+SELECT count(*) FROM test_quad WHERE p <@ box '(2,3),(6,8)' AND p << '(4,4)';
+
+SELECT count(*) FROM test_quad WHERE p >> '(5.0,5.0)' AND p >^ '(5.0,5.0)';
+
+SET enable_indexscan=on;
+
+EXPLAIN (COSTS OFF)
+SELECT p FROM test_quad ORDER BY p <-> '(5,5)' LIMIT 5;
+
+SELECT p FROM test_quad ORDER BY p <-> '(5,5)' LIMIT 5;
+
+SELECT sum(leaf_tuples) FROM spg_analyze('tqidx');
+
+CREATE TABLE test_quad_median AS SELECT * FROM test_quad;
+
+CREATE INDEX tqmidx ON test_quad_median USING spgist (p point_quadtree_median_ops);
+
+SELECT * FROM test_quad_median WHERE p ~= '(8.51277472174491,5.86434731598175)';
+
+SELECT * FROM test_quad_median WHERE p ~= '(1.39955907884019,9.12045046572942)';
+
+CREATE TABLE test_kd AS SELECT * FROM test_quad;
+
+CREATE INDEX tkdidx ON test_kd USING spgist (p point_kd_ops);
+
+SELECT * FROM test_kd WHERE p ~= '(8.51277472174491,5.86434731598175)';
+
+SELECT * FROM test_kd WHERE p ~= '(1.39955907884019,9.12045046572942)';
+
+SET spgist.track_stats = on;
+
+SELECT count(*) FROM test_quad WHERE p <@ box '(2,3),(6,8)';
+
+SELECT indexrelid, scans, leaf_matched FROM spg_stat_scans;
+
+-- stopping early must not leave a scan of the totals open
+SELECT indexrelid FROM spg_scan_stats() LIMIT 1;
+
+SELECT spg_scan_stats_reset();
+
+INSERT INTO test_kd SELECT point(i, i) FROM generate_series(1, 3) i;
+
+SELECT event, count, (SELECT sum(h) FROM unnest(time_hist) h) = count AS timed
+	FROM spg_insert_stats() WHERE event = 'insert';
+
+SELECT event FROM spg_insert_stats() LIMIT 1;
+
+SELECT spg_insert_stats_reset();
+
+SET spgist.track_stats = off;
+
+SELECT function, calls, ns_per_op > 0 AS timed
+	FROM spg_bench_opclass('point_kd_ops', 'test_quad', 2);
+
+CREATE TABLE test_quad_ff AS SELECT * FROM test_quad;
+
+CREATE INDEX tqffidx ON test_quad_ff USING spgist (p)
+	WITH (fillfactor = 50, inner_fillfactor = 70, max_chain_length = 16);
+
+SELECT reloptions FROM pg_class WHERE relname = 'tqffidx';
+
+SELECT count(*) FROM test_quad_ff WHERE p <@ box '(2,3),(6,8)';
+
+SELECT * FROM test_quad_ff WHERE p ~= '(8.51277472174491,5.86434731598175)';
+
+SET spgist.cache_levels = 3;
+
+SELECT count(*) FROM test_text WHERE t ^@ 'http://www.a';
+
+SELECT count(*) FROM test_quad WHERE p <@ box '(2,3),(6,8)';
+
+INSERT INTO test_text VALUES ('http://www.data-wales.co.uk/lamb.htm');
+
+SELECT count(*) FROM test_text WHERE t = 'http://www.data-wales.co.uk/lamb.htm';
+
+RESET spgist.cache_levels;
+
+CREATE TABLE test_cluster (p point NOT NULL);
+
+INSERT INTO test_cluster SELECT * FROM test_quad;
+
+CREATE INDEX tclidx ON test_cluster USING spgist (p);
+
+CLUSTER test_cluster USING tclidx;
+
+SELECT count(*) FROM test_cluster WHERE p <@ box '(2,3),(6,8)';
+
+ALTER TABLE test_cluster ALTER p DROP NOT NULL;
+
+INSERT INTO test_cluster VALUES (NULL);
+
+CLUSTER test_cluster;
+
+SELECT count(*) FROM test_cluster WHERE p IS NULL;
+
+-- keyless ordered scans return NULLs last
+CREATE TABLE test_knn_null (p point);
+
+INSERT INTO test_knn_null VALUES ('(1,1)'), (NULL), ('(3,3)'), ('(2,2)'), (NULL);
+
+CREATE INDEX tknnnullidx ON test_knn_null USING spgist (p);
+
+INSERT INTO test_knn_null VALUES (NULL), ('(0,1)');
+
+SELECT p FROM test_knn_null ORDER BY p <-> '(0,0)';
+
+SELECT p FROM test_knn_null ORDER BY p <-> '(0,0)' LIMIT 5;
+
+-- 160 times (0,0) and 140 times (1,1), mixed so the median of the
+-- page being split is (0,0)
+CREATE TABLE test_quad_dup AS
+	SELECT CASE WHEN i % 15 < 8 THEN point(0, 0) ELSE point(1, 1) END AS p
+	FROM generate_series(0, 299) i;
+
+CREATE INDEX tqdupidx ON test_quad_dup USING spgist (p point_quadtree_median_ops);
+
+SELECT count(*) FROM test_quad_dup WHERE p ~= '(1,1)';
+
+CREATE TABLE test_quad_chain AS SELECT * FROM test_quad;
+
+CREATE INDEX tqchidx ON test_quad_chain USING spgist (p) WITH (max_chain_length = 4);
+
+-- chains of equal points are dealt out to the nodes of all-same tuples
+INSERT INTO test_quad_chain SELECT point(5, 5) FROM generate_series(1, 20);
+
+SELECT count(*) FROM test_quad_chain WHERE p ~= '(5,5)';
+
+-- more equal points than a leaf page holds
+CREATE TABLE test_quad_same AS SELECT point(3, 3) AS p FROM generate_series(1, 1000);
+
+CREATE INDEX tqsameidx ON test_quad_same USING spgist (p);
+
+INSERT INTO test_quad_same SELECT point(i, i) FROM generate_series(1, 5) i;
+
+SELECT count(*) FROM test_quad_same WHERE p ~= '(3,3)';
+
+SELECT count(*) FROM test_quad_same WHERE p <@ box '(2,2),(4,4)';
+
+SELECT p FROM test_quad_same ORDER BY p <-> '(1.1,1.1)' LIMIT 3;
+
+-- every 5 letter word over 'abcd', short chains make a deep tree whose
+-- inner pages are full
+CREATE TABLE test_move AS
+	SELECT chr(97 + i / 256 % 4) || chr(97 + i / 64 % 4) || chr(97 + i / 16 % 4) ||
+		chr(97 + i / 4 % 4) || chr(97 + i % 4) AS t
+	FROM generate_series(0, 1023) i;
+
+CREATE INDEX tmoveidx ON test_move USING spgist (t) WITH (max_chain_length = 2);
+
+SET spgist.cache_levels = 4;
+
+SET spgist.track_stats = on;
+
+SELECT count(*) FROM test_move WHERE t ^@ 'abc';
+
+-- 'e' as the last letter adds a node to the lowest inner tuples, which
+-- have to move to other pages
+INSERT INTO test_move SELECT substr(t, 1, 4) || 'e' FROM test_move WHERE t LIKE '%a';
+
+SELECT count > 0 AS moved FROM spg_insert_stats()
+	WHERE indexrelid = 'tmoveidx'::regclass AND event = 'add node with move';
+
+SELECT count(*) FROM test_move WHERE t ^@ 'abc';
+
+SELECT count(*) FROM test_move WHERE t = 'dcbae';
+
+SELECT spg_insert_stats_reset();
+
+RESET spgist.track_stats;
+
+RESET spgist.cache_levels;
+
+-- a chain of one tuple can't be split
+CREATE INDEX ttchidx ON test_move USING spgist (t) WITH (max_chain_length = 1);
+
+CREATE TABLE test_text_chain (t text);
+
+CREATE INDEX ttchidx ON test_text_chain USING spgist (t) WITH (max_chain_length = 2);
+
+INSERT INTO test_text_chain SELECT 'a' || i % 3 FROM generate_series(1, 30) i;
+
+INSERT INTO test_text_chain VALUES ('b');
+
+SELECT count(*) FROM test_text_chain WHERE t = 'a1';
+
+SELECT count(*) FROM test_text_chain WHERE t = 'b';
+
+-- points within EPSILON of the centroid (0,0), picksplit must put them
+-- into the same quadrants as choose and the scans do
+CREATE TABLE test_quad_eps AS
+	SELECT point(x * 5e-7, y * 5e-7) AS p
+	FROM generate_series(-4, 4) x, generate_series(-4, 4) y, generate_series(1, 5);
+
+CREATE TABLE test_quad_eps_heap AS SELECT * FROM test_quad_eps;
+
+CREATE INDEX tqepsidx ON test_quad_eps USING spgist (p point_quadtree_median_ops);
+
+SELECT count(*) FROM generate_series(-4, 4) x, generate_series(-4, 4) y
+	WHERE (SELECT count(*) FROM test_quad_eps WHERE p ~= point(x * 5e-7, y * 5e-7)) <>
+		(SELECT count(*) FROM test_quad_eps_heap WHERE p ~= point(x * 5e-7, y * 5e-7));